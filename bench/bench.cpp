@@ -0,0 +1,126 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <functional>
+#include <filesystem>
+#include <cstdio>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "tnyvec.hpp"
+
+// every operator new in the process, including std containers that don't
+// go through a memory resource
+std::atomic<size_t> heap_allocations = 0;
+
+// out of line, or gcc sees free on memory from new
+[[gnu::noinline]] void* operator new(size_t size) {
+    heap_allocations++;
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* ptr) noexcept { std::free(ptr); }
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// runs op until it has taken at least min_time, after one warm up run
+struct Result { size_t ops; double ns, allocs, heap; };
+Result measure(const std::function<void(tnyvec::CountingResource&)>& op) {
+    static constexpr auto min_time = std::chrono::milliseconds(300);
+
+    tnyvec::CountingResource warm_up; op(warm_up);
+
+    tnyvec::CountingResource counter;
+    const size_t heap_before = heap_allocations;
+    const auto begin = Clock::now();
+    size_t ops = 0;
+    for (size_t n = 1; Clock::now() - begin < min_time; n *= 2)
+        for (size_t i = 0; i < n; i++, ops++) op(counter);
+    const double ns = std::chrono::duration<double, std::nano>(
+        Clock::now() - begin).count();
+
+    return {ops, ns / ops, double(counter.allocations) / ops,
+        double(heap_allocations - heap_before) / ops};
+}
+
+// Script's arena takes its upstream from the default resource
+struct UseDefault {
+    std::pmr::memory_resource* const prev;
+    explicit UseDefault(std::pmr::memory_resource* resource)
+        : prev(std::pmr::set_default_resource(resource)) {}
+    ~UseDefault() { std::pmr::set_default_resource(prev); }
+};
+
+long peak_rss_kb() {
+    rusage usage; getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void report(const std::string& name, const Result& result) {
+    std::cout << name << '\t' << result.ops << '\t' << result.ns << '\t'
+        << result.allocs << '\t' << result.heap << '\t' << peak_rss_kb()
+        << '\n' << std::flush;
+}
+
+// parse/<file> lexes and parses a file, exec/<file> runs its parsed ast
+// in a fresh Env, parse/large parses all files repeated up to 1 MiB and
+// load/large loads that from an ast cache written before the first run.
+// allocs counts allocations from memory resources (values and the ast
+// arena), heap counts operator new and peak_rss_kb is the process high
+// water mark so far. output is tab separated for diffing across commits
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " file.tny...\n";
+        return 1;
+    }
+
+    std::cout << "case\tops\tns/op\tallocs/op\theap/op\tpeak_rss_kb\n";
+    std::string all;
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        if (!file) {
+            std::cerr << "can't open " << argv[i] << '\n';
+            return 1;
+        }
+        std::stringstream in; in << file.rdbuf();
+        const std::string src = in.str(); all += src + '\n';
+
+        std::string name = argv[i];
+        name = name.substr(name.find_last_of('/') + 1);
+        name = name.substr(0, name.find('.'));
+
+        report("parse/" + name, measure([&](tnyvec::CountingResource& c) {
+            const UseDefault use(&c); const tnyvec::Script script(src);
+        }));
+
+        const tnyvec::Script script(src);
+        report("exec/" + name, measure([&](tnyvec::CountingResource& c) {
+            tnyvec::Env env; env.resource = &c;
+            tnyvec::exec(script.ast, env);
+        }));
+    }
+
+    std::string large;
+    while (large.size() < (1 << 20)) large += all;
+    report("parse/large", measure([&](tnyvec::CountingResource& c) {
+        const UseDefault use(&c); const tnyvec::Script script(large);
+    }));
+
+    const std::string cache = std::filesystem::temp_directory_path() /
+        ("tnyvec_bench_" + std::to_string(getpid()) + ".ast");
+    { const tnyvec::Script script(large, cache); }
+    report("load/large", measure([&](tnyvec::CountingResource& c) {
+        const UseDefault use(&c); const tnyvec::Script script(large, cache);
+    }));
+    std::remove(cache.c_str());
+}
@@ -1,17 +1,82 @@
 #include <string>
+#include <string_view>
 #include <iostream>
-#include <vector>
+#include <fstream>
+#include <exception>
+#include <optional>
+#include <chrono>
+#include <cstdlib>
+
+#include <unistd.h>
 
 #include "tnyvec.hpp"
 
-int main() {
-    tnyvec::Env env;
+// TNYVEC_PROFILE=out.folded profiles the run, writing its folded stacks
+// there and a report to stderr. TNYVEC_SAMPLE=us samples every us
+// instead of timing each call
+struct Profile {
+    const char* const path = std::getenv("TNYVEC_PROFILE");
+    std::optional<tnyvec::Profiler> profiler;
+
+    explicit Profile(tnyvec::Env& env) {
+        if (!path) return;
+        const char* sample = std::getenv("TNYVEC_SAMPLE");
+        profiler.emplace(env,
+            std::chrono::microseconds(sample ? std::atol(sample) : 0));
+    }
+    ~Profile() {
+        if (!profiler) return;
+        std::ofstream out(path); profiler->folded(out);
+        profiler->report(std::cerr);
+    }
+};
 
-    std::string in;
-    while (true) {
-        std::cout << ">>> "; std::getline(std::cin, in);
-        std::vector<std::string> toks = tnyvec::lex(in);
-        tnyvec::print(tnyvec::exec(tnyvec::parse(toks), env));
-        std::cout << std::endl;
+// runs the file given, or stdin, one top level form at a time and prints
+// what each form evaluates to. only a terminal gets prompts and keeps
+// going after an error. with a cache path the file is mapped whole and
+// its ast loaded from the cache, see Script
+int main(int argc, char** argv) {
+    tnyvec::Env env; const Profile profile(env);
+    auto run = [&](tnyvec::Args form) {
+        tnyvec::print(tnyvec::exec(form, env));
+        std::cout << '\n';
     };
-}
\ No newline at end of file
+
+    if (argc > 2) try {
+        const tnyvec::Mapped file(argv[1]);
+        if (!file) {
+            std::cerr << "can't open " << argv[1] << '\n';
+            return 1;
+        }
+        const tnyvec::Script script(file.view(), argv[2]);
+        for (const auto& form : script.ast) run({&form, 1});
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "error: " << e.what() << '\n';
+        return 1;
+    }
+
+    std::ifstream file;
+    if (argc > 1) {
+        file.open(argv[1]);
+        if (!file) {
+            std::cerr << "can't open " << argv[1] << '\n';
+            return 1;
+        }
+    }
+    const bool interactive = argc < 2 && isatty(STDIN_FILENO);
+    tnyvec::Reader reader(argc > 1 ? file : std::cin,
+        interactive ? &std::cout : nullptr);
+
+    std::string_view form;
+    while (reader.next(form)) {
+        try {
+            const tnyvec::Script script(form, reader.line, reader.col);
+            run(script.ast);
+        } catch (const std::exception& e) {
+            std::cerr << "error: " << e.what() << '\n';
+            if (!interactive) return 1;
+        }
+    }
+    if (interactive) std::cout << '\n';
+}
@@ -2,68 +2,489 @@
 
 #include <unordered_map>
 #include <string>
-#include <stack>
 #include <vector>
-#include <functional>
-#include <variant>
-#include <sstream>
+#include <bit>
+#include <iostream>
+#include <span>
+#include <string_view>
+#include <charconv>
 #include <stdexcept>
+#include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <tuple>
+#include <limits>
+#include <cmath>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdlib>
+#include <shared_mutex>
+#include <deque>
+#include <list>
+#include <optional>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace tnyvec {
 
-struct Data;
+// runtime values come from here unless Env::resource says otherwise
+std::pmr::memory_resource* pool() {
+    static std::pmr::synchronized_pool_resource pool;
+    return &pool;
+}
+
+thread_local std::pmr::memory_resource* current = nullptr;
+std::pmr::memory_resource* current_resource() {
+    return current ? current : pool();
+}
+
+// values made in an arena can't outlive it, so they are pinned: copies
+// of them are deep and come from wherever values come from at the time
+thread_local bool pinned = false;
+thread_local uint64_t made = 0; // heap values made on this thread
+
+// makes resource the source of new values until it goes out of scope
+struct UseResource {
+    std::pmr::memory_resource* const prev = current;
+    const bool prev_pinned = pinned;
+    explicit UseResource(std::pmr::memory_resource* resource,
+        bool arena = false) {
+        current = resource; pinned = arena;
+    }
+    ~UseResource() { current = prev; pinned = prev_pinned; }
+};
+
+// thrown when exec runs out of a Budget or a CountingResource's limit
+struct BudgetExceeded : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// forwards to upstream and counts what passes through, e.g. per exec.
+// as Env::resource, limit caps the memory held by values of that Env
+struct CountingResource : std::pmr::memory_resource {
+    std::pmr::memory_resource* upstream;
+    std::atomic<size_t> allocations = 0, deallocations = 0, bytes = 0,
+        peak = 0;
+    size_t limit = std::numeric_limits<size_t>::max(); // in bytes
+
+    explicit CountingResource(std::pmr::memory_resource* upstream = pool())
+        : upstream(upstream) {}
+
+private:
+    void* do_allocate(size_t size, size_t align) override {
+        const size_t now = bytes += size;
+        if (now > limit) {
+            bytes -= size;
+            throw BudgetExceeded("memory budget exceeded");
+        }
+        void* ptr;
+        try {
+            ptr = upstream->allocate(size, align);
+        } catch (...) {
+            bytes -= size;
+            throw;
+        }
+        allocations++;
+        size_t max = peak;
+        while (now > max && !peak.compare_exchange_weak(max, now));
+        return ptr;
+    }
+    void do_deallocate(void* ptr, size_t size, size_t align) override {
+        upstream->deallocate(ptr, size, align);
+        deallocations++; bytes -= size;
+    }
+    bool do_is_equal(const memory_resource& rhs) const noexcept override {
+        return this == &rhs;
+    }
+};
+
+// another resource behind a lock, which the worker Envs of parallel
+// builtins make their values through, as Env::resource needn't be thread
+// safe. values keep the resource they came from, so there is one for
+// each resource, made once and kept for the life of the process
+struct LockedResource : std::pmr::memory_resource {
+    std::pmr::memory_resource* const upstream; std::mutex mutex;
+    explicit LockedResource(std::pmr::memory_resource* upstream) :
+        upstream(upstream) {}
+
+private:
+    void* do_allocate(size_t size, size_t align) override {
+        const std::lock_guard lock(mutex);
+        return upstream->allocate(size, align);
+    }
+    void do_deallocate(void* ptr, size_t size, size_t align) override {
+        const std::lock_guard lock(mutex);
+        upstream->deallocate(ptr, size, align);
+    }
+    bool do_is_equal(const memory_resource& rhs) const noexcept override {
+        return this == &rhs;
+    }
+};
+
+// resource made safe to share between threads, pool() is already
+std::pmr::memory_resource* locked(std::pmr::memory_resource* resource) {
+    if (resource == pool() || dynamic_cast<LockedResource*>(resource))
+        return resource;
+    static std::mutex mutex;
+    static std::unordered_map<std::pmr::memory_resource*,
+        std::unique_ptr<LockedResource>> all;
+    const std::lock_guard lock(mutex);
+    std::unique_ptr<LockedResource>& entry = all[resource];
+    if (!entry) entry = std::make_unique<LockedResource>(resource);
+    return entry.get();
+}
+
+// every symbol name gets a process wide id the first time it is seen.
+// parse stores symbols as their id and compiled code refers to globals
+// by id, so it runs in any Env
+struct Symbols {
+    std::shared_mutex mutex;
+    std::deque<std::string> names; // stable, ids key into it
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+Symbols& symbols() {
+    static Symbols symbols;
+    return symbols;
+}
+
+uint32_t intern(std::string_view name) {
+    Symbols& table = symbols();
+    {
+        const std::shared_lock lock(table.mutex);
+        auto it = table.ids.find(name);
+        if (it != table.ids.end()) return it->second;
+    }
+    const std::unique_lock lock(table.mutex);
+    auto it = table.ids.find(name);
+    if (it != table.ids.end()) return it->second;
+    table.names.emplace_back(name);
+    return table.ids[table.names.back()] = table.names.size() - 1;
+}
+
+const std::string& symbol_name(uint32_t id) {
+    Symbols& table = symbols();
+    const std::shared_lock lock(table.mutex);
+    return table.names[id];
+}
+
+struct Symbol { uint32_t id; };
+struct Data; struct Cell; struct Slice;
+
+using Vec = std::pmr::vector<Data>;
+using Packed = std::pmr::vector<double>; // the elements of an f64 vector
+// cells by symbol id. ids count every symbol the process has interned,
+// locals and keys too, so cells come in pages made once one of theirs is
+// bound: a copy costs the pages in use, not a cell for every id below
+// the highest one bound
+struct Scope {
+    static constexpr uint32_t PAGE = 64;
+    struct Page;
+    std::vector<std::unique_ptr<Page>> pages;
+
+    Scope() = default;
+    Scope(const Scope& rhs);
+    Scope(Scope&&) = default;
+    Scope& operator=(const Scope& rhs) { return *this = Scope(rhs); }
+    Scope& operator=(Scope&&) = default;
+    ~Scope();
+
+    uint32_t size() const { return pages.size() * PAGE; } // ids below
+    // the cell of id, null if its page wasn't made
+    const Cell* find(uint32_t id) const;
+    Cell* find(uint32_t id);
+    Cell& at(uint32_t id); // making its page if need be
+    // pages are never dropped, so once found a cell can be read this way
+    const Cell& operator[](uint32_t id) const;
+};
+// a frame's slots start at base in Env::stack and line up with fn's locals
+// vm frames also keep where to resume the caller, and their callee sits
+// just below base for as long as the call runs
+namespace vm { struct Chunk; struct Instr; struct Native; }
+struct Profiler;
+struct Suspended;
+struct Snapshot;
+
+// limits on an Env, and the Envs of its parallel builtins. steps are
+// loop back edges and fn calls, and every CHECK_EVERY of them exec
+// checks the budget, throwing BudgetExceeded once something is used up.
+// interrupt can be set from any thread and stays set until cleared.
+// depth caps nested fn calls, which the walker makes on the c++ stack
+struct Budget {
+    static constexpr uint64_t CHECK_EVERY = 1024;
+    uint64_t steps = std::numeric_limits<uint64_t>::max();
+    size_t depth = std::numeric_limits<size_t>::max();
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    std::atomic<bool> interrupt = false;
+    std::atomic<uint64_t> used = 0; // steps so far
+
+    void check() {
+        if (interrupt.load(std::memory_order_relaxed))
+            throw BudgetExceeded("interrupted");
+        if (used.fetch_add(CHECK_EVERY, std::memory_order_relaxed) +
+            CHECK_EVERY > steps)
+            throw BudgetExceeded("step budget exceeded");
+        if (std::chrono::steady_clock::now() > deadline)
+            throw BudgetExceeded("time budget exceeded");
+    }
+};
 
-using Scope = std::unordered_map<std::string, Data>;
+struct Fn;
+struct Frame {
+    const Fn* fn; size_t base;
+    const vm::Chunk* chunk = nullptr; const vm::Instr* ip = nullptr;
+    // a chunk tail called out of, whose sites are released on return
+    std::shared_ptr<const vm::Chunk> left;
+};
+// what an Env keeps for one chunk it ran: the closure each CLOSURE op
+// made last, and what each CALL_GLOBAL found in the cell it calls, see
+// vm CALL_GLOBAL, and each builtin it runs inline, see vm::current.
+// serial is the chunk's, whose slot a later one may reuse
+struct Sites {
+    struct Callee { uint32_t version = 0; bool builtin = false; };
+    uint64_t serial = 0; Vec closures;
+    std::vector<Callee> calls, cores;
+};
 struct Env {
-    Scope global_scope; std::stack<Scope> local_scope;
+    Scope global_scope;
+    // defines that replaced a builtin, after which chunks check the ones
+    // they were compiled against, see vm::current
+    uint32_t rebinds = 0;
+    Vec stack; // frame slots and vm operands
+    std::vector<Frame> frames;
+    std::vector<Sites> sites; // by vm::Chunk::slot, see vm::sites
+    bool tree_walk = false; // run exec through eval instead of the vm
+    std::pmr::memory_resource* resource = pool(); // for values made by exec
+    // globals are read from here and can't be assigned, see ThreadPool
+    Env* shared = nullptr;
+    Profiler* profiler = nullptr; // set while one is attached
+    Budget* budget = nullptr;
+    uint64_t steps = 0; // taken by this Env, see Budget
+    // calls and back edges into a chunk before it runs natively, see
+    // vm::tier. NEVER keeps every chunk in the vm
+    static constexpr uint32_t NEVER = -1;
+    uint32_t hot = 1000;
+    // builtin calls in progress, and which of them may suspend the run
+    uint32_t calls = 0, suspend_at = 0;
+    std::shared_ptr<Suspended> suspended; // see suspend
     Env();
+    // a worker with its own stack, making values through locked(resource)
+    explicit Env(Env* shared);
+    explicit Env(const Snapshot& snapshot); // starts from its globals
 };
 
-using Vec = std::vector<Data>;
-using Builtin = std::function<Data(const Vec& args, Env& env)>;
+using Args = std::span<const Data>; // unevaluated, borrowed from the ast
+using Builtin = Data (*)(Args args, Env& env);
+struct Memo;
+bool same(const Data& lhs, const Data& rhs); // slices with equal elements
+bool empty(const Data& slice);
 struct Fn {
-    std::vector<std::string> params; Vec ast;
+    static constexpr uint32_t ANONYMOUS = -1;
+    // how a slot is shared with the fns made in the body, see share
+    enum Slot : uint8_t { BY_VALUE, BY_REF, BY_SELF };
+    std::vector<uint32_t> params; Vec ast; // params are symbol ids
+    uint32_t name = ANONYMOUS; // symbol it was first assigned to
+    std::vector<uint32_t> locals; // frame slot names, see resolve_locals
+    // the slots after params, filled from captured, see make_fn
+    uint32_t captures = 0; Vec captured;
+    std::vector<Slot> slots; // by slot, empty if all are BY_VALUE
+    bool ref(size_t slot) const {
+        return slot < slots.size() && slots[slot] == BY_REF;
+    }
+    // captured refs and selves can lead back to the fn, so == and hash
+    // take them by box and don't look inside
+    bool boxed(size_t captured) const {
+        const size_t slot = params.size() + captured;
+        return slot < slots.size() && slots[slot] != BY_VALUE;
+    }
+    std::shared_ptr<Memo> memo; // results by args, set by the memo builtin
+    // compiled ast, filled in on first call if fn was made by the walker
+    std::shared_ptr<const vm::Chunk> chunk;
+};
+// the storage of a map or a set (whose vals stay nil): entries in the
+// order they were put, except that removing one moves the last into its
+// place, and an open addressed index of them probed linearly by hash
+struct Table {
+    struct Entry;
+    std::pmr::vector<Entry> entries;
+    std::pmr::vector<uint32_t> slots; // entry + 1, 0 if free
+
+    Table() = default;
+    explicit Table(std::pmr::memory_resource* resource) :
+        entries(resource), slots(resource) {}
+    Table(const Table& rhs, std::pmr::memory_resource* resource) :
+        entries(rhs.entries, resource), slots(rhs.slots, resource) {}
+    Table(Table&& rhs, std::pmr::memory_resource* resource) :
+        entries(std::move(rhs.entries), resource),
+        slots(std::move(rhs.slots), resource) {}
+
+    size_t size() const { return entries.size(); }
+    const Data* find(const Data& key) const;
+    Data& put(const Data& key); // the val of key, added as nil if missing
+    bool remove(const Data& key);
+
+    // same keys, and also the same vals if vals
+    friend bool same(const Table& lhs, const Table& rhs, bool vals);
+
+private:
+    // the slot of key, or the free one where it would go
+    size_t probe(const Data& key, uint64_t hash) const;
+    void grow();
 };
+// nan-boxed: a double is stored as is, any other type is a negative nan
+// tagged with the type, whose low 48 bits point to the heap value (an
+// empty vec is a null pointer). heap values come from current_resource()
+// and remember it so they can be freed again. builtins and symbols are
+// not owned, their low 48 bits are the function pointer or symbol id.
+// copies share the heap value through an atomic refcount, the mut_
+// accessors copy it first if it is shared. pinned values have no count.
 struct Data {
-    enum {VEC, BUILTIN, FN, SYMBOL, NUM, STR} type;
-    std::variant<Vec, Builtin, Fn, std::string, double> val;
+    enum Type : uint8_t {
+        NUM, VEC, BUILTIN, FN, SYMBOL, STR, F64, MAP, SET, SLICE
+    };
+
+    Data() = default;
+    Data(Type, double num) :
+        bits(num == num ? std::bit_cast<uint64_t>(num) : NAN_BITS) {}
+    Data(Type, Vec vec) : bits(vec.empty() ?
+        tagged(VEC, nullptr) : make<Vec>(VEC, std::move(vec))) {}
+    Data(Type, Builtin builtin) : bits(tagged(BUILTIN,
+        reinterpret_cast<const void*>(builtin))) {}
+    Data(Type, Fn fn) : bits(make<Fn>(FN, std::move(fn))) {}
+    Data(Type, Symbol symbol) : bits(tagged(SYMBOL, symbol.id)) {}
+    Data(Type type, std::string str) :
+        bits(make<std::string>(type, std::move(str))) {}
+    Data(Type, Packed packed) : bits(make<Packed>(F64, std::move(packed))) {}
+    Data(Type type, Table table) :
+        bits(make<Table>(type, std::move(table))) {}
+    Data(Type, Slice slice);
+
+    Data(const Data& rhs) : bits(rhs.boxed() ? rhs.share() : rhs.bits) {}
+    Data(Data&& rhs) noexcept : bits(rhs.bits) { rhs.bits = NIL; }
+    ~Data() { release(); }
+
+    Data& operator=(const Data& rhs) {
+        if (this == &rhs) return *this;
+        const uint64_t copy = rhs.boxed() ? rhs.share() : rhs.bits;
+        release(); bits = copy;
+        return *this;
+    }
+    Data& operator=(Data&& rhs) noexcept {
+        if (this == &rhs) return *this;
+        release(); bits = rhs.bits; rhs.bits = NIL;
+        return *this;
+    }
+
+    Type type() const { return bits < TAG_MIN ? NUM : Type(bits >> 48 & 0xF); }
+    double num() const { return std::bit_cast<double>(bits); }
+    const Vec& vec() const {
+        static const Vec empty;
+        return ptr() ? get<Vec>() : empty;
+    }
+    Builtin builtin() const { return reinterpret_cast<Builtin>(ptr()); }
+    const Fn& fn() const { return get<Fn>(); }
+    const std::string& str() const { return get<std::string>(); }
+    const Packed& packed() const { return get<Packed>(); }
+    const Table& table() const { return get<Table>(); }
+    const Slice& slice() const { return get<Slice>(); }
+    uint32_t symbol() const { return uint32_t(bits); }
+    const std::string& name() const { return symbol_name(symbol()); }
+
+    Vec& mut_vec() {
+        if (!ptr()) bits = make<Vec>(VEC, Vec());
+        return unique<Vec>();
+    }
+    Fn& mut_fn() { return unique<Fn>(); }
+    std::string& mut_str() { return unique<std::string>(); }
+    Packed& mut_packed() { return unique<Packed>(); }
+    Table& mut_table() { return unique<Table>(); }
+    // a ref is a vec of one val that the frames and closures sharing a
+    // local all hold, see Fn::slots, and that changes in place for them
+    const Data& ref() const { return get<Vec>()[0]; }
+    Data& mut_ref() {
+        header()->hash.store(0, std::memory_order_relaxed);
+        return get<Vec>()[0];
+    }
+    // the same box, or the same unboxed value
+    bool identical(const Data& rhs) const { return bits == rhs.bits; }
+    // how many copies share the box, 0 if it is pinned
+    uint32_t holders() const {
+        return refs().load(std::memory_order_acquire);
+    }
+    // whether a mut_ accessor would copy
+    bool shared() const {
+        return boxed() && refs().load(std::memory_order_acquire) != 1;
+    }
+    // where hash keeps the hash of a heap value, 0 until it is known.
+    // the mut_ accessors reset it
+    std::atomic<uint32_t>* hash_cache() const {
+        return boxed() ? &header()->hash : nullptr;
+    }
 
     bool operator==(const Data& rhs) const {
-        if (type != rhs.type) return false;
+        // a slice is equal to the vector it views the elements of
+        if (type() != rhs.type())
+            return (type() == SLICE || rhs.type() == SLICE) && same(*this, rhs);
 
-        switch(type) {
-        case Data::BUILTIN:
-            return std::get<Builtin>(val).target_type().name() ==
-                std::get<Builtin>(rhs.val).target_type().name();
+        switch(type()) {
+        case Data::BUILTIN: return builtin() == rhs.builtin();
 
         case Data::FN: {
-            const std::vector<std::string>& lhs_params =
-                std::get<Fn>(val).params;
-            const std::vector<std::string>& rhs_params =
-                std::get<Fn>(rhs.val).params;
-            const Vec& lhs_ast = std::get<Fn>(val).ast;
-            const Vec& rhs_ast = std::get<Fn>(rhs.val).ast;
+            const std::vector<uint32_t>& lhs_params = fn().params;
+            const std::vector<uint32_t>& rhs_params = rhs.fn().params;
+            const Vec& lhs_ast = fn().ast;
+            const Vec& rhs_ast = rhs.fn().ast;
+            const Vec& lhs_captured = fn().captured;
+            const Vec& rhs_captured = rhs.fn().captured;
             if (lhs_params.size() != rhs_params.size() ||
-                lhs_ast.size() != rhs_ast.size()) return false;
+                lhs_ast.size() != rhs_ast.size() ||
+                lhs_captured.size() != rhs_captured.size() ||
+                fn().slots != rhs.fn().slots) return false;
             else {
                 for (size_t i = 0; i < lhs_params.size(); i++)
                     if (lhs_params[i] != rhs_params[i]) return false;
                 for (size_t i = 0; i < lhs_ast.size(); i++)
                     if (!(lhs_ast[i] == rhs_ast[i])) return false;
+                for (size_t i = 0; i < lhs_captured.size(); i++)
+                    if (fn().boxed(i) ?
+                        lhs_captured[i].bits != rhs_captured[i].bits :
+                        !(lhs_captured[i] == rhs_captured[i])) return false;
                 return true;
             }
         }
 
-        case Data::SYMBOL: case Data::STR:
-            return std::get<std::string>(val) ==
-                std::get<std::string>(rhs.val);
+        case Data::SYMBOL: return symbol() == rhs.symbol();
+        case Data::STR: return str() == rhs.str();
+
+        case Data::NUM: return num() == rhs.num();
+        case Data::F64: return packed() == rhs.packed();
 
-        case Data::NUM:
-            return std::get<double>(val) == std::get<double>(rhs.val);
+        case Data::MAP: case Data::SET:
+            return same(table(), rhs.table(), type() == MAP);
+        case Data::SLICE: return same(*this, rhs);
 
         case Data::VEC: {
-            const Vec& lhs_vec = std::get<Vec>(val);
-            const Vec& rhs_vec = std::get<Vec>(rhs.val);
+            const Vec& lhs_vec = vec();
+            const Vec& rhs_vec = rhs.vec();
             if (lhs_vec.size() != rhs_vec.size()) return false;
             else {
                 for (size_t i = 0; i < lhs_vec.size(); i++)
@@ -78,359 +499,3672 @@ struct Data {
     }
 
     operator bool() const {
-        switch (type) {
-        case Data::VEC: return !std::get<Vec>(val).empty();
-        case Data::BUILTIN: return (bool)std::get<Builtin>(val);
-        case Data::FN: return !std::get<Fn>(val).ast.empty();
-        case Data::SYMBOL: case Data::STR:
-            return !std::get<std::string>(val).empty();
-        case Data::NUM: return std::get<double>(val);
+        switch (type()) {
+        case Data::VEC: return !vec().empty();
+        case Data::BUILTIN: return builtin();
+        case Data::FN: return !fn().ast.empty();
+        case Data::SYMBOL: return true;
+        case Data::STR: return !str().empty();
+        case Data::NUM: return num();
+        case Data::F64: return !packed().empty();
+        case Data::MAP: case Data::SET: return table().size();
+        case Data::SLICE: return !empty(*this);
         default:
             throw std::runtime_error("unknown data type in Data.operatorbool");
     }
 }
-};
 
-std::vector<std::string> lex(const std::string& in) {
-    std::string in_modified = in;
+private:
+    static constexpr uint64_t TAG_MIN = 0xFFF1'0000'0000'0000,
+        PTR_MASK = 0x0000'FFFF'FFFF'FFFF, NAN_BITS = 0x7FF8'0000'0000'0000,
+        NIL = 0xFFF0'0000'0000'0000 | uint64_t(VEC) << 48;
 
-    static auto replace = [](std::string& in, const std::string& pattern,
-        const std::string& result) {
+    static uint64_t tagged(Type type, uint64_t low) {
+        return 0xFFF0'0000'0000'0000 | uint64_t(type) << 48 | low;
+    }
+    static uint64_t tagged(Type type, const void* ptr) {
+        return tagged(type, reinterpret_cast<uintptr_t>(ptr));
+    }
 
-        size_t pos = 0;
-        while ((pos = in.find(pattern, pos)) != std::string::npos) {
-            in.replace(pos, pattern.size(), result);
-            pos += result.size();
-        }
+    // first in every box, so it can be read without knowing the type
+    struct Header {
+        std::pmr::memory_resource* resource;
+        std::atomic<uint32_t> refs; // 0 if pinned
+        std::atomic<uint32_t> hash; // see hash_cache
     };
+    template <typename T> struct Box : Header { T val; };
+
+    void* ptr() const { return reinterpret_cast<void*>(bits & PTR_MASK); }
+    bool boxed() const {
+        return bits >= TAG_MIN && ptr() && type() != BUILTIN &&
+            type() != SYMBOL;
+    }
+    template <typename T> Box<T>* box() const {
+        return static_cast<Box<T>*>(ptr());
+    }
+    template <typename T> T& get() const { return box<T>()->val; }
+
+    Header* header() const { return static_cast<Header*>(ptr()); }
+    std::atomic<uint32_t>& refs() const { return header()->refs; }
 
-    replace(in_modified, "(", " ( ");
-    replace(in_modified, ")", " ) ");
+    uint64_t share() const {
+        std::atomic<uint32_t>& count = refs();
+        if (count.load(std::memory_order_relaxed) == 0) return clone();
+        count.fetch_add(1, std::memory_order_relaxed);
+        return bits;
+    }
 
-    std::istringstream in_stream(in_modified);
-    std::string tok; std::vector<std::string> toks;
+    template <typename T> T& unique() {
+        if (refs().load(std::memory_order_acquire) > 1) {
+            const uint64_t copy = clone();
+            release(); bits = copy;
+        }
+        header()->hash.store(0, std::memory_order_relaxed);
+        return get<T>();
+    }
 
-    while (in_stream >> tok) {
-        if (tok.empty()) continue;
-        if (tok.front() == '"' && (tok.size() == 1 || tok.back() != '"')) {
-            std::string str;
-            std::getline(in_stream, str, '"');
-            tok += str + '"';
+    template <typename T, typename U>
+    static uint64_t make(Type type, U&& val) {
+        std::pmr::memory_resource* resource = current_resource();
+        const uint32_t refs = pinned ? 0 : 1;
+        void* mem = resource->allocate(sizeof(Box<T>), alignof(Box<T>));
+        made++;
+        try {
+            if constexpr (std::is_same_v<T, Vec> ||
+                std::is_same_v<T, Packed> || std::is_same_v<T, Table>)
+                new (mem) Box<T>{{resource, refs, 0},
+                    T(std::forward<U>(val), resource)};
+            else new (mem) Box<T>{{resource, refs, 0},
+                T(std::forward<U>(val))};
+        } catch (...) {
+            resource->deallocate(mem, sizeof(Box<T>), alignof(Box<T>));
+            throw;
         }
-        toks.push_back(tok);
+        return tagged(type, mem);
+    }
+
+    template <typename T> void destroy() {
+        auto* box = static_cast<Box<T>*>(ptr());
+        std::pmr::memory_resource* resource = box->resource;
+        box->~Box<T>();
+        resource->deallocate(box, sizeof(Box<T>), alignof(Box<T>));
     }
-    return toks;
-}
 
-Vec parse(std::vector<std::string>& toks, Vec ast = Vec()) {
-    if (toks.empty()) return ast;
-    std::string tok = toks.front(); toks.erase(toks.begin());
+    uint64_t clone() const {
+        switch (type()) {
+        case VEC: return make<Vec>(VEC, vec());
+        case FN: return make<Fn>(FN, fn());
+        case F64: return make<Packed>(F64, packed());
+        case MAP: case SET: return make<Table>(type(), table());
+        case SLICE: return make<Slice>(SLICE, slice());
+        default: return make<std::string>(STR, str());
+        }
+    }
 
-    if (tok == "(") {
-        ast.push_back({Data::VEC, parse(toks, Vec())});
-        return parse(toks, ast);
-    } else if (tok == ")") return ast;
-    else {
-        double num;
-        try {num = std::stod(tok);}
-        catch (...) {
-            if (tok.front() == '"' && tok.back() == '"') {
-                tok.erase(tok.begin()); tok.pop_back();
-                ast.push_back({Data::STR, tok});
-            } else ast.push_back({Data::SYMBOL, tok});
-            return parse(toks, ast);
+    void release() {
+        if (!boxed()) return;
+        std::atomic<uint32_t>& count = refs();
+        if (count.load(std::memory_order_relaxed) != 0 &&
+            count.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+        switch (type()) {
+        case VEC: destroy<Vec>(); break;
+        case FN: destroy<Fn>(); break;
+        case F64: destroy<Packed>(); break;
+        case MAP: case SET: destroy<Table>(); break;
+        case SLICE: destroy<Slice>(); break;
+        default: destroy<std::string>();
         }
-        ast.push_back({Data::NUM, num});
-        return parse(toks, ast);
     }
+
+    uint64_t bits = NIL;
+    friend struct vm::Native; // works on the bits of nums and nil
+};
+static_assert(sizeof(Data) == 8);
+
+struct Table::Entry { Data key, val; uint64_t hash; };
+
+// a view of size elements of an f64 vector or a vec from begin, sharing
+// them with of until either is changed, see Data::mut_vec
+struct Slice { Data of; size_t begin, size; };
+
+Data::Data(Type, Slice slice) : bits(make<Slice>(SLICE, std::move(slice))) {}
+
+// an f64 vector or a slice of one, is_vec likewise
+bool is_f64(const Data& data) {
+    return data.type() == Data::F64 || (data.type() == Data::SLICE &&
+        data.slice().of.type() == Data::F64);
+}
+bool is_vec(const Data& data) {
+    return data.type() == Data::VEC || (data.type() == Data::SLICE &&
+        data.slice().of.type() == Data::VEC);
 }
 
-Data exec(const Vec& ast, Env& env);
+// the elements of data, which is_f64
+std::span<const double> doubles(const Data& data) {
+    if (data.type() == Data::F64) return data.packed();
+    const Slice& slice = data.slice();
+    return std::span(slice.of.packed()).subspan(slice.begin, slice.size);
+}
+// the elements of data, which is_vec
+Args items(const Data& data) {
+    if (data.type() == Data::VEC) return data.vec();
+    const Slice& slice = data.slice();
+    return Args(slice.of.vec()).subspan(slice.begin, slice.size);
+}
 
-Data eval(const Data& data, Env& env) {
-    switch (data.type) {
-    case Data::BUILTIN: case Data::NUM: case Data::STR: return data; break;
-    case Data::SYMBOL: {
-        const std::string ident = std::get<std::string>(data.val);
+bool same(const Data& lhs, const Data& rhs) {
+    if (is_f64(lhs) != is_f64(rhs)) return false;
+    if (is_f64(lhs)) {
+        const auto xs = doubles(lhs), ys = doubles(rhs);
+        return std::equal(xs.begin(), xs.end(), ys.begin(), ys.end());
+    }
+    const Args xs = items(lhs), ys = items(rhs);
+    return std::equal(xs.begin(), xs.end(), ys.begin(), ys.end());
+}
 
-        if (!env.local_scope.empty() &&
-            env.local_scope.top().find(ident) != env.local_scope.top().end()) {
+bool empty(const Data& slice) { return slice.slice().size == 0; }
 
-            return env.local_scope.top().at(ident);
-        } else if (env.global_scope.find(ident) != env.global_scope.end())
-            return env.global_scope.at(ident);
-        else throw std::runtime_error("undefined symbol " + ident);
-    } break;
-    case Data::VEC: {
-        auto vec = std::get<Vec>(data.val);
-        if (vec.empty()) throw std::runtime_error("can't call empty vector");
+// version counts the defines of a bound cell, so it is never 0, see vm
+// CALL_GLOBAL
+struct Cell { Data val; bool bound = false; uint32_t version = 0; };
 
-        Data fn = eval(vec[0], env); vec.erase(vec.begin());
-        if (fn.type == Data::BUILTIN)
-            return std::get<Builtin>(fn.val)(vec, env);
-        else if (fn.type == Data::FN) {
-            const std::vector<std::string>& params =
-                std::get<Fn>(fn.val).params;
-            const Vec& ast = std::get<Fn>(fn.val).ast;
+struct Scope::Page { Cell cells[PAGE]; };
 
-            if (params.size() != vec.size())
-                throw std::runtime_error("invalid number of params in fn call");
+Scope::Scope(const Scope& rhs) : pages(rhs.pages.size()) {
+    for (size_t i = 0; i < pages.size(); i++)
+        if (rhs.pages[i]) pages[i] = std::make_unique<Page>(*rhs.pages[i]);
+}
+Scope::~Scope() = default;
 
-            Scope scope;
-            for (size_t i = 0; i < params.size(); i++)
-                scope[params[i]] = eval(vec[i], env);
+const Cell* Scope::find(uint32_t id) const {
+    const size_t page = id / PAGE;
+    return page < pages.size() && pages[page] ?
+        &pages[page]->cells[id % PAGE] : nullptr;
+}
+Cell* Scope::find(uint32_t id) {
+    return const_cast<Cell*>(static_cast<const Scope*>(this)->find(id));
+}
+const Cell& Scope::operator[](uint32_t id) const {
+    return pages[id / PAGE]->cells[id % PAGE];
+}
+Cell& Scope::at(uint32_t id) {
+    const size_t page = id / PAGE;
+    if (page >= pages.size()) pages.resize(page + 1);
+    if (!pages[page]) pages[page] = std::make_unique<Page>();
+    return pages[page]->cells[id % PAGE];
+}
 
-            env.local_scope.push(scope);
-            const Data result = exec(ast, env);
-            env.local_scope.pop();
-            return result;
-        } else throw std::runtime_error("unexpected data type in call");
-    } break;
-    default: throw std::runtime_error("unknown data type in eval");
+// the slots of a frame just opened that fn shares: BY_REF params and
+// locals get a new ref, and a BY_SELF slot that was captured before it
+// was assigned gets self, see share
+void share_frame(const Fn& fn, const Data& self, Data* slots) {
+    const size_t from = fn.params.size(), to = from + fn.captures;
+    for (size_t i = 0; i < fn.slots.size(); i++) {
+        Data& slot = slots[i];
+        const bool own = i < from || i >= to;
+        if (fn.slots[i] == Fn::BY_REF && own) {
+            Vec ref(current_resource()); ref.push_back(std::move(slot));
+            slot = {Data::VEC, std::move(ref)};
+        } else if (fn.slots[i] == Fn::BY_SELF && !own &&
+            slot.type() == Data::VEC && slot.vec().empty()) slot = self;
     }
 }
 
-Data exec(const Vec& ast, Env& env) {
-    if (ast.empty()) throw std::runtime_error("can't exec empty ast");
-    Data result;
-    for (const auto& expr : ast) result = eval(expr, env);
-    return result;
+// grows the stack from the args at base to the frame of the fn callee
+void open_frame(const Data& callee, Vec& stack, size_t base) {
+    const Fn& fn = callee.fn();
+    Data self;
+    if (!fn.slots.empty()) self = callee; // callee may be on the stack
+    stack.resize(base + fn.locals.size());
+    std::copy(fn.captured.begin(), fn.captured.end(),
+        stack.begin() + base + fn.params.size());
+    if (!fn.slots.empty()) share_frame(fn, self, stack.data() + base);
 }
 
-void print(const Data& data, std::ostream& out = std::cout) {
-    switch (data.type) {
-    case Data::BUILTIN:
-        out << "BUILTIN:" << std::get<Builtin>(data.val).target_type().name();
-        break;
+namespace vm { Vec* closures(const Chunk& chunk, Env& env); }
 
-    case Data::FN: {
-        const Fn& fn = std::get<Fn>(data.val);
-        const std::vector<std::string>& params = fn.params;
-        out << "FN:(";
-        for (auto it = params.begin(); it != params.end(); it++) {
-            out << *it;
-            if (it != params.end() - 1) out << " ";
-        }
-        out << "){";
-        for (const auto& expr : fn.ast) print(expr);
-        out << "}";
-    } break;
+// whether a frame's own refs hold fns, which may be in a cycle
+bool cyclic(const Fn& fn, const Data* slots) {
+    const size_t from = fn.params.size(), to = from + fn.captures;
+    for (size_t i = 0; i < fn.slots.size(); i++)
+        if (fn.slots[i] == Fn::BY_REF && (i < from || i >= to) &&
+            slots[i].type() == Data::VEC &&
+            slots[i].ref().type() == Data::FN) return true;
+    return false;
+}
 
-    case Data::SYMBOL: out << std::get<std::string>(data.val); break;
-    case Data::NUM: out << std::get<double>(data.val); break;
-    case Data::STR: out << '"' << std::get<std::string>(data.val) << '"'; break;
+// fns made in a frame that capture each other, one of them through a ref,
+// are a cycle the refcounts never free. before the frame is dropped, the
+// refs in its own slots and the fns in those and in its other own slots
+// that nothing but each other, the frame and the CLOSURE sites of its
+// chunk hold, closures if the vm ran it, are let go of: the refs emptied
+// and the sites cleared
+void collect(const Fn& fn, Data* slots, Vec* closures) {
+    if (!cyclic(fn, slots)) return;
+    constexpr size_t MOST = 16;
+    const Data* boxes[MOST]; uint32_t in[MOST]; bool ref[MOST], live[MOST];
+    size_t n = 0;
+    auto find = [&](const Data& data) {
+        size_t j = 0;
+        while (j < n && !boxes[j]->identical(data)) j++;
+        return j;
+    };
+    // counts a hold on box from inside, adding it the first time
+    auto hold = [&](const Data& box, bool is_ref) {
+        if (const size_t j = find(box); j < n) in[j]++;
+        else if (n < MOST) { boxes[n] = &box; ref[n] = is_ref; in[n++] = 1; }
+        return n < MOST;
+    };
+    const size_t from = fn.params.size(), to = from + fn.captures;
+    for (size_t i = 0; i < fn.locals.size(); i++) {
+        if (i >= from && i < to) continue;
+        const Data& slot = slots[i];
+        if (fn.ref(i) && slot.type() == Data::VEC) {
+            if (!hold(slot, true)) return;
+            if (slot.ref().type() == Data::FN && !hold(slot.ref(), false))
+                return;
+        } else if (slot.type() == Data::FN && !hold(slot, false)) return;
+    }
 
-    case Data::VEC: {
-        const auto& vec = std::get<Vec>(data.val);
-        out << "(";
-        for (auto it = vec.begin(); it != vec.end(); it++) {
-            print(*it);
-            if (it != vec.end() - 1) out << " ";
+    for (size_t k = 0; k < n; k++)
+        if (!ref[k])
+            for (const Data& held : boxes[k]->fn().captured)
+                if (const size_t j = find(held); j < n) in[j]++;
+    if (closures) for (const Data& site : *closures)
+        if (const size_t j = find(site); j < n) in[j]++;
+    for (size_t k = 0; k < n; k++) {
+        if (boxes[k]->holders() == 0) return;
+        live[k] = boxes[k]->holders() > in[k];
+    }
+    // and what a live one holds stays with it
+    for (bool more = true; more;) {
+        more = false;
+        for (size_t k = 0; k < n; k++) {
+            if (!live[k]) continue;
+            if (!ref[k]) {
+                for (const Data& held : boxes[k]->fn().captured)
+                    if (const size_t j = find(held); j < n && !live[j])
+                        live[j] = more = true;
+            } else if (const size_t j = find(boxes[k]->ref());
+                j < n && !live[j]) live[j] = more = true;
         }
-        out << ")";
-    } break;
-
-    default: throw std::runtime_error("unknown data type in print");
     }
+    for (size_t k = 0; k < n; k++)
+        if (!live[k] && !ref[k] && closures) for (Data& site : *closures)
+            if (site.identical(*boxes[k])) site = Data();
+    for (size_t k = 0; k < n; k++)
+        if (!live[k] && ref[k]) const_cast<Data*>(boxes[k])->mut_ref() = Data();
 }
 
-namespace builtin {
+// args to fn are already pushed from base up, the remaining locals are
+// bumped on top and everything is dropped again when the call is over
+struct Call {
+    Env& env; const size_t base;
 
-#define ARITHMETIC_OPERATION(FN_NAME, OPERATION) \
-Data FN_NAME(const Vec& args, Env& env) { \
-    if (args.size() < 2) \
-        throw std::runtime_error("not enough args for " \
-            + std::string(#FN_NAME)); \
-    Data data = eval(args[0], env); \
-    if (data.type != Data::NUM) \
-        throw std::runtime_error("invalid argument for " \
-            + std::string(#FN_NAME)); \
-    double result = std::get<double>(data.val); \
-    for (auto it = args.begin() + 1; it != args.end(); it++) { \
-        if ((data = eval(*it, env)).type != Data::NUM) \
-            throw std::runtime_error("invalid argument for " \
-                + std::string(#FN_NAME)); \
-        result OPERATION std::get<double>(data.val); \
-    } \
-    return {Data::NUM, result}; \
-}
+    Call(Env& env, const Data& callee, size_t base) : env(env), base(base) {
+        const Fn* fn = &callee.fn(); // callee may be on the stack
+        open_frame(callee, env.stack, base);
+        env.frames.push_back({fn, base});
+    }
+    ~Call() {
+        const Fn& fn = *env.frames.back().fn;
+        if (!fn.slots.empty()) collect(fn, env.stack.data() + base,
+            fn.chunk ? vm::closures(*fn.chunk, env) : nullptr);
+        env.frames.pop_back(); env.stack.resize(base);
+    }
+};
 
-ARITHMETIC_OPERATION(sum, +=)
-ARITHMETIC_OPERATION(sub, -=)
-ARITHMETIC_OPERATION(mul, *=)
-ARITHMETIC_OPERATION(div, /=)
+namespace builtin { const char* name(Builtin fn); }
 
-#define RELATIONAL_OPERATION(FN_NAME, OPERATION) \
-Data FN_NAME(const Vec& args, Env& env) { \
-    if (args.size() != 2) \
-        throw std::runtime_error("invalid number of args for " \
-            + std::string(#FN_NAME)); \
-    const Data lhs = eval(args[0], env); \
-    if (lhs.type != Data::NUM) \
-        throw std::runtime_error("invalid lhs argument for " \
-            + std::string(#FN_NAME)); \
-    const double lhs_val = std::get<double>(lhs.val); \
-    const Data rhs = eval(args[1], env); \
-    if (rhs.type != Data::NUM) \
-        throw std::runtime_error("invalid rhs argument for " \
-            + std::string(#FN_NAME)); \
-    const double rhs_val = std::get<double>(rhs.val); \
-    return {Data::NUM, double(lhs_val OPERATION rhs_val)}; \
+// while attached to an Env, every fn and builtin call made in it is a
+// node in a call tree that counts calls, heap values made and either the
+// time spent or the samples taken. the vm runs arithmetic, compares and
+// the special forms inline, so those only show up from the walker.
+// worker Envs aren't profiled, parallel builtins get their time instead
+struct Profiler {
+    using Clock = std::chrono::steady_clock;
+
+    // with an interval, samples on a thread instead of timing each call
+    explicit Profiler(Env& env, std::chrono::microseconds interval = {});
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    void enter(const char* label);
+    void leave();
+    size_t depth() const { return active.size(); }
+    void unwind(size_t depth) { while (active.size() > depth) leave(); }
+
+    // "exec;f;g n" per call stack, n being the samples taken or the
+    // microseconds spent in g itself, the input flamegraph.pl takes
+    void folded(std::ostream& out) const;
+    // a tab separated line per fn or builtin, most exclusive time first
+    void report(std::ostream& out) const;
+
+    static const char* label(const Fn& fn) {
+        return fn.name == Fn::ANONYMOUS ? "fn" : symbol_name(fn.name).c_str();
+    }
+    static const char* label(Builtin fn) {
+        const char* name = builtin::name(fn);
+        return name ? name : "builtin";
+    }
+
+private:
+    // a node's counts leave out its children
+    struct Node {
+        const char* label; size_t parent; std::vector<size_t> children;
+        uint64_t calls = 0, ns = 0, made = 0, samples = 0;
+    };
+    struct Active {
+        size_t node; Clock::time_point start; uint64_t made;
+        uint64_t child_ns = 0, child_made = 0;
+    };
+
+    Env& env; const std::chrono::microseconds interval;
+    std::vector<Node> nodes; std::vector<Active> active;
+
+    std::atomic<uint64_t> ticks = 0; // sampler periods not yet counted
+    std::mutex mutex; std::condition_variable wake; bool stop = false;
+    std::thread sampler;
+
+    // everything that happened between two calls happened in one node
+    void sample() {
+        if (!ticks.load(std::memory_order_relaxed)) return;
+        nodes[active.back().node].samples += ticks.exchange(0);
+    }
+    std::vector<Node> totals() const;
+};
+
+Profiler::Profiler(Env& env, std::chrono::microseconds interval) :
+    env(env), interval(interval) {
+    nodes.push_back({"exec", 0, {}, 1});
+    active.push_back({0, Clock::now(), made});
+    env.profiler = this;
+    if (interval.count()) sampler = std::thread([this] {
+        std::unique_lock lock(mutex);
+        while (!wake.wait_for(lock, this->interval, [this] { return stop; }))
+            ticks++;
+    });
 }
 
-RELATIONAL_OPERATION(lt, <)
-RELATIONAL_OPERATION(gt, >)
-RELATIONAL_OPERATION(lteq, <=)
-RELATIONAL_OPERATION(gteq, >=)
+Profiler::~Profiler() {
+    if (sampler.joinable()) {
+        { const std::lock_guard lock(mutex); stop = true; }
+        wake.notify_all(); sampler.join();
+    }
+    env.profiler = nullptr;
+}
 
-Data eq(const Vec& args, Env& env) {
-    if (args.size() != 2)
-        throw std::runtime_error("invalid number of args for eq");
-    const Data lhs = eval(args[0], env);
-    const Data rhs = eval(args[1], env);
-    return {Data::NUM, double(lhs == rhs)};
+void Profiler::enter(const char* label) {
+    sample();
+    const size_t parent = active.back().node;
+    size_t node = 0;
+    for (const size_t child : nodes[parent].children)
+        if (nodes[child].label == label) { node = child; break; }
+    if (!node) {
+        node = nodes.size(); nodes.push_back({label, parent});
+        nodes[parent].children.push_back(node);
+    }
+    nodes[node].calls++;
+    active.push_back({node, interval.count() ? Clock::time_point() :
+        Clock::now(), made});
 }
 
-#define LOGICAL_OPERATION(FN_NAME, OPERATION) \
-Data FN_NAME(const Vec& args, Env& env) { \
-    if (args.size() != 2) \
-        throw std::runtime_error("invalid number of args for " \
-            + std::string(#FN_NAME)); \
-    const Data lhs = eval(args[0], env); \
-    const Data rhs = eval(args[1], env); \
-    return {Data::NUM, double(bool(lhs) OPERATION bool(rhs))}; \
+void Profiler::leave() {
+    if (active.size() == 1) return;
+    sample();
+    const Active done = active.back(); active.pop_back();
+    Node& node = nodes[done.node];
+    const uint64_t values = made - done.made;
+    node.made += values - done.child_made;
+    active.back().child_made += values;
+    if (interval.count()) return;
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - done.start).count();
+    node.ns += ns - done.child_ns;
+    active.back().child_ns += ns;
 }
 
-LOGICAL_OPERATION(land, &&)
-LOGICAL_OPERATION(lor, ||)
+// the nodes with the calls still running counted up to now, and samples
+// turned into time
+std::vector<Profiler::Node> Profiler::totals() const {
+    std::vector<Node> result = nodes;
+    const auto now = Clock::now();
+    for (size_t i = active.size(); i-- > 0;) {
+        const Active& call = active[i];
+        Node& node = result[call.node];
+        node.made += made - call.made - call.child_made;
+        if (!interval.count()) node.ns += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(now - call.start).count() -
+            call.child_ns;
+    }
+    if (!interval.count()) return result;
+    result[active.back().node].samples += ticks.load();
+    for (Node& node : result) node.ns = node.samples *
+        std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count();
+    return result;
+}
 
-Data lnot(const Vec& args, Env& env) {
-    if (args.size() != 1)
-        throw std::runtime_error("invalid number of args for lnot");
-    const Data rhs = eval(args[0], env);
-    if (rhs.type != Data::NUM)
-        std::runtime_error("invalid argument for lnot");
-    return {Data::NUM, double(!bool(rhs))};
+void Profiler::folded(std::ostream& out) const {
+    const std::vector<Node> totals = this->totals();
+    std::vector<std::pair<size_t, std::string>> todo = {{0, "exec"}};
+    while (!todo.empty()) {
+        auto [node, path] = std::move(todo.back()); todo.pop_back();
+        const uint64_t value = interval.count() ? totals[node].samples :
+            totals[node].ns / 1000;
+        if (value) out << path << ' ' << value << '\n';
+        for (const size_t child : totals[node].children)
+            todo.push_back({child, path + ';' + totals[child].label});
+    }
 }
 
-Data cond_if(const Vec& args, Env& env) {
-    if (args.size() != 3)
-        throw std::runtime_error("invalid number of args for cond_if");
+void Profiler::report(std::ostream& out) const {
+    const std::vector<Node> totals = this->totals();
+    std::vector<uint64_t> inclusive(totals.size());
+    for (size_t i = totals.size(); i-- > 0;) {
+        inclusive[i] += totals[i].ns;
+        if (i) inclusive[totals[i].parent] += inclusive[i];
+    }
 
-    Data condition = eval(args[0], env);
-    if (condition) return eval(args[1], env);
-    else return eval(args[2], env);
+    struct Line { const char* label; uint64_t calls, incl, excl, made; };
+    std::vector<Line> lines;
+    for (size_t i = 0; i < totals.size(); i++) {
+        const Node& node = totals[i];
+        auto it = std::find_if(lines.begin(), lines.end(),
+            [&](const Line& line) { return line.label == node.label; });
+        if (it == lines.end()) it = lines.insert(lines.end(), {node.label});
+        it->calls += node.calls; it->excl += node.ns; it->made += node.made;
+        // a recursive call is already in the time of its outermost call
+        bool outermost = true;
+        for (size_t up = i; up && outermost;)
+            outermost = totals[up = totals[up].parent].label != node.label;
+        if (outermost) it->incl += inclusive[i];
+    }
+    std::sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) {
+        return a.excl > b.excl;
+    });
+
+    out << "name\tcalls\tincl_ms\texcl_ms\tmade\n";
+    for (const Line& line : lines)
+        out << line.label << '\t' << line.calls << '\t' << line.incl / 1e6
+            << '\t' << line.excl / 1e6 << '\t' << line.made << '\n';
 }
 
-Data when(const Vec& args, Env& env) {
-    if (args.size() < 2)
-        throw std::runtime_error("invalid number of args for when");
+// enters a node for as long as it lives, if env is profiled
+struct Profiled {
+    Profiler* const profiler;
+    template <typename Callee> Profiled(Env& env, const Callee& callee) :
+        profiler(env.profiler) {
+        if (profiler) profiler->enter(Profiler::label(callee));
+    }
+    ~Profiled() { if (profiler) profiler->leave(); }
+};
 
-    Data condition = eval(args[0], env);
-    Vec ast = args; ast.erase(ast.begin());
+// counts the calls in progress for suspend
+struct Nested {
+    Env& env;
+    explicit Nested(Env& env) : env(env) { env.calls++; }
+    ~Nested() { env.calls--; }
+};
 
-    Data result;
-    if (condition) result = exec(ast, env);
-    return result;
+Data call(Builtin fn, Args args, Env& env) {
+    const Nested nested(env);
+    if (!env.profiler) return fn(args, env);
+    const Profiled profiled(env, fn);
+    return fn(args, env);
 }
 
-Data loop_while(const Vec& args, Env& env) {
-    if (args.size() < 2)
-        throw std::runtime_error("invalid number of args for loop_while");
+// a run stopped at a call to an async builtin. the host makes the call
+// fn and args stand for, then resumes with its result
+struct Suspended {
+    Builtin fn; Vec args;
+    // where the vm goes on, see vm::run
+    std::shared_ptr<const vm::Chunk> entry; const vm::Chunk* chunk = nullptr;
+    const vm::Instr* ip = nullptr; size_t base = 0, depth = 0, profiled = 0;
+};
 
-    Data condition = args[0];
-    Vec ast = args; ast.erase(ast.begin());
+// text points into the lexed input, which has to outlive the tokens
+struct Token { std::string_view text; size_t line, col; };
 
-    Data result;
-    while (eval(condition, env)) result = exec(ast, env);
-    return result;
+bool space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' ||
+        c == '\v';
 }
 
-Data loop_for(const Vec& args, Env& env) {
-    if (args.size() < 4)
-        throw std::runtime_error("invalid number of args for loop_for");
+// positions count from line and col, where in starts in its file
+std::vector<Token> lex(std::string_view in, size_t line = 1, size_t col = 1) {
+    std::vector<Token> toks; size_t line_begin = 0, shift = col - 1;
+    for (size_t i = 0; i < in.size();) {
+        if (in[i] == '\n') { line++; line_begin = ++i; shift = 0; continue; }
+        if (space(in[i])) { i++; continue; }
 
-    eval(args[0], env); // initial
-    Data condition = args[1], increment = args[2];
-    Vec ast = args; ast.erase(ast.begin(), ast.begin() + 3);
+        const size_t begin = i, tok_line = line,
+            col = i - line_begin + 1 + shift;
+        if (in[i] == '(' || in[i] == ')') i++;
+        else if (in[i] == '"') {
+            i = in.find('"', i + 1);
+            if (i == std::string_view::npos)
+                throw std::runtime_error("unterminated string at " +
+                    std::to_string(tok_line) + ":" + std::to_string(col));
+            for (size_t j = begin; j < i; j++)
+                if (in[j] == '\n') { line++; line_begin = j + 1; shift = 0; }
+            i++;
+        } else while (i < in.size() && !space(in[i]) && in[i] != '(' &&
+            in[i] != ')') i++;
 
-    Data result;
-    while (eval(condition, env)) {
-        result = exec(ast, env);
-        eval(increment, env);
+        toks.push_back({in.substr(begin, i - begin), tok_line, col});
     }
-    return result;
+    return toks;
 }
 
-Data assign(const Vec& args, Env& env) {
-    if (args.size() < 2 && args.size() % 2 == 0)
-        throw std::runtime_error("invalid number of args for assign");
+// numbers are tokens from_chars reads in full, strings keep their quotes
+Data atom(std::string_view tok) {
+    const char* begin = tok.data(); const char* end = begin + tok.size();
+    if (tok.size() > 1 && tok[0] == '+' && tok[1] != '-') begin++;
 
-    static auto add_to_scope = [](const std::string& ident, const Data& data,
-        Env& env) -> Data {
+    double num;
+    const auto result = std::from_chars(begin, end, num);
+    if (result.ec == std::errc() && result.ptr == end) return {Data::NUM, num};
+    if (tok.size() > 1 && tok.front() == '"' && tok.back() == '"')
+        return {Data::STR, std::string(tok.substr(1, tok.size() - 2))};
+    return {Data::SYMBOL, Symbol{intern(tok)}};
+}
 
-        if (!env.local_scope.empty()) env.local_scope.top()[ident] = data;
-        else env.global_scope[ident] = data;
-        return data;
+// vecs still waiting for their ) are kept on open instead of the c++ stack
+Vec parse(std::span<const Token> toks) {
+    static auto at = [](const Token& tok) {
+        return std::to_string(tok.line) + ":" + std::to_string(tok.col);
     };
 
-    Data result;
-    for (auto it = args.begin(); it != args.end(); it += 2) {
-        if (it->type != Data::SYMBOL)
-            throw std::runtime_error("lhs in assign is not symbol");
-        result = add_to_scope(
-            std::get<std::string>(it->val), eval(*(it + 1), env), env
-        );
+    std::vector<Vec> open; std::vector<const Token*> parens;
+    open.emplace_back(current_resource());
+    for (const Token& tok : toks) {
+        if (tok.text == "(") {
+            open.emplace_back(current_resource()); parens.push_back(&tok);
+        } else if (tok.text == ")") {
+            if (parens.empty())
+                throw std::runtime_error("unexpected ) at " + at(tok));
+            Vec vec = std::move(open.back());
+            open.pop_back(); parens.pop_back();
+            open.back().push_back({Data::VEC, std::move(vec)});
+        } else open.back().push_back(atom(tok.text));
     }
-    return result;
+    if (!parens.empty())
+        throw std::runtime_error("unbalanced ( at " + at(*parens.back()));
+    return std::move(open.front());
 }
 
-Data fn(const Vec& args, Env& env) {
-    if (args.size() < 2) throw std::runtime_error("not enough args for fn");
+// read only view of a whole file, false if it can't be opened
+struct Mapped {
+    explicit Mapped(const std::string& path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            size = info.st_size; opened = true;
+            if (size) data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) { data = nullptr; opened = false; }
+        }
+        close(fd);
+    }
+    ~Mapped() { if (data) munmap(data, size); }
+    Mapped(const Mapped&) = delete;
+    Mapped& operator=(const Mapped&) = delete;
 
-    Fn result;
+    explicit operator bool() const { return opened; }
+    std::string_view view() const {
+        return {static_cast<const char*>(data), data ? size : 0};
+    }
 
-    Data params = args[0];
-    if (params.type != Data::VEC)
-        throw std::runtime_error("params for fn is not a vec");
-    for (const auto& data : std::get<Vec>(params.val))
-        if (data.type != Data::SYMBOL)
-            throw std::runtime_error("param is not symbol");
-        else result.params.push_back(std::get<std::string>(data.val));
-    for (auto it = args.begin() + 1; it != args.end(); it++)
-        result.ast.push_back(*it);
+private:
+    void* data = nullptr; size_t size = 0; bool opened = false;
+};
 
-    return {Data::FN, result};
+// fnv-1a, ties an ast cache to the exact source it was parsed from and
+// checks that the rest of the cache is intact
+uint64_t hash(std::string_view in) {
+    uint64_t sum = 0xCBF2'9CE4'8422'2325;
+    for (const char c : in) sum = (sum ^ uint8_t(c)) * 0x100'0000'01B3;
+    return sum;
+}
+
+void mix(uint64_t& sum, uint64_t x) {
+    sum = (sum ^ x) * 0xBF58'476D'1CE4'E5B9; sum ^= sum >> 31;
+}
+
+uint64_t hash(const Data& data);
+
+// of a sequence of data such as the args of a call
+uint64_t hash(Args items) {
+    uint64_t sum = items.size();
+    for (const auto& item : items) mix(sum, hash(item));
+    return sum;
+}
+
+// structural, data that compare equal hash the same. equal nums can
+// differ in sign only as 0 and -0, adding 0 makes both 0. 32 bits, which
+// heap values keep, see Data::hash_cache
+uint64_t hash(const Data& data) {
+    std::atomic<uint32_t>* cache = data.hash_cache();
+    if (cache)
+        if (const uint32_t known = cache->load(std::memory_order_relaxed))
+            return known;
+    // a slice hashes as the kind of vector it views, which it equals
+    const Data::Type type = data.type() == Data::SLICE ?
+        data.slice().of.type() : data.type();
+    uint64_t sum = 0x9E37'79B9'7F4A'7C15 * (type + 1);
+    auto mix = [&](uint64_t x) { tnyvec::mix(sum, x); };
+    switch (data.type()) {
+    case Data::NUM: mix(std::bit_cast<uint64_t>(data.num() + 0.0)); break;
+    case Data::SYMBOL: mix(data.symbol()); break;
+    case Data::BUILTIN: mix(reinterpret_cast<uintptr_t>(data.builtin()));
+        break;
+    case Data::STR: mix(hash(std::string_view(data.str()))); break;
+    case Data::MAP: case Data::SET: {
+        // the order entries are in doesn't matter
+        uint64_t entries = 0;
+        for (auto [key, val, sum] : data.table().entries) {
+            if (data.type() == Data::MAP) tnyvec::mix(sum, hash(val));
+            entries += sum;
+        }
+        mix(data.table().size()); mix(entries);
+    } break;
+    case Data::F64: case Data::SLICE:
+        if (!is_f64(data)) {
+            mix(hash(items(data)));
+            break;
+        }
+        mix(doubles(data).size());
+        for (const double x : doubles(data))
+            mix(std::bit_cast<uint64_t>(x + 0.0));
+        break;
+    case Data::VEC: mix(hash(Args(data.vec()))); break;
+    case Data::FN: {
+        const Fn& fn = data.fn();
+        for (const uint32_t param : fn.params) mix(param);
+        mix(hash(Args(fn.ast))); mix(fn.captured.size());
+        for (size_t i = 0; i < fn.captured.size(); i++)
+            if (!fn.boxed(i)) mix(hash(fn.captured[i]));
+    } break;
+    }
+    // folded the same with or without a cache, as an unboxed value can
+    // equal a boxed one, say an empty vec and one with capacity
+    const uint32_t known = uint32_t(sum ^ sum >> 32) | 1;
+    if (cache) cache->store(known, std::memory_order_relaxed);
+    return known;
+}
+
+size_t Table::probe(const Data& key, uint64_t hash) const {
+    const size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (!slots[i]) return i;
+        const Entry& entry = entries[slots[i] - 1];
+        if (entry.hash == hash && entry.key == key) return i;
+    }
+}
+
+// keeps the index at most half full
+void Table::grow() {
+    slots.assign(std::max<size_t>(8, slots.size() * 2), 0);
+    const size_t mask = slots.size() - 1;
+    for (size_t e = 0; e < entries.size(); e++) {
+        size_t i = entries[e].hash & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = e + 1;
+    }
+}
+
+const Data* Table::find(const Data& key) const {
+    if (entries.empty()) return nullptr;
+    const size_t i = probe(key, hash(key));
+    return slots[i] ? &entries[slots[i] - 1].val : nullptr;
+}
+
+Data& Table::put(const Data& key) {
+    if ((entries.size() + 1) * 2 > slots.size()) grow();
+    const uint64_t sum = hash(key);
+    const size_t i = probe(key, sum);
+    if (!slots[i]) {
+        entries.push_back({key, {}, sum});
+        slots[i] = entries.size();
+    }
+    return entries[slots[i] - 1].val;
+}
+
+bool Table::remove(const Data& key) {
+    if (entries.empty()) return false;
+    const size_t mask = slots.size() - 1;
+    size_t i = probe(key, hash(key));
+    if (!slots[i]) return false;
+    const size_t removed = slots[i] - 1;
+
+    // shift back the entries after it that would no longer be found
+    for (size_t j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+        const size_t home = entries[slots[j] - 1].hash & mask;
+        if (((j - home) & mask) < ((j - i) & mask)) continue;
+        slots[i] = slots[j]; i = j;
+    }
+    slots[i] = 0;
+
+    // and move the last entry into the hole
+    const size_t last = entries.size() - 1;
+    if (removed != last) {
+        size_t at = entries[last].hash & mask;
+        while (slots[at] != last + 1) at = (at + 1) & mask;
+        slots[at] = removed + 1;
+        entries[removed] = std::move(entries[last]);
+    }
+    entries.pop_back();
+    return true;
+}
+
+bool same(const Table& lhs, const Table& rhs, bool vals) {
+    if (lhs.size() != rhs.size()) return false;
+    for (const auto& [key, val, sum] : lhs.entries) {
+        const Data* other = rhs.find(key);
+        if (!other || (vals && !(val == *other))) return false;
+    }
+    return true;
+}
+
+// roughly the bytes data keeps alive
+size_t footprint(const Data& data) {
+    size_t bytes = sizeof(Data);
+    switch (data.type()) {
+    case Data::VEC:
+        if (data.vec().empty()) break;
+        bytes += sizeof(Vec);
+        for (const auto& item : data.vec()) bytes += footprint(item);
+        break;
+    case Data::STR: bytes += sizeof(std::string) + data.str().size(); break;
+    case Data::F64:
+        bytes += sizeof(Packed) + data.packed().size() * sizeof(double);
+        break;
+    case Data::FN: bytes += sizeof(Fn); break;
+    case Data::SLICE: bytes += sizeof(Slice); break;
+    case Data::MAP: case Data::SET:
+        bytes += sizeof(Table) + data.table().slots.size() * sizeof(uint32_t);
+        for (const auto& [key, val, hash] : data.table().entries)
+            bytes += footprint(key) + footprint(val) + sizeof(hash);
+        break;
+    default: break;
+    }
+    return bytes;
+}
+
+// results of a pure fn by its args. once there are more than entries of
+// them, or they take more than bytes (0 is no limit), the least recently
+// used go first. copies of the fn and worker threads share one Memo
+struct Memo {
+    struct Stats {
+        uint64_t hits = 0, misses = 0, evictions = 0;
+        size_t entries = 0, bytes = 0;
+    };
+
+    explicit Memo(size_t entries, size_t bytes = 0) :
+        max_entries(entries), max_bytes(bytes) {}
+
+    // a miss counts until the result is inserted
+    bool find(Args args, uint64_t hash, Data& result);
+    void insert(Vec args, uint64_t hash, const Data& result);
+    Stats stats() const {
+        const std::lock_guard lock(mutex);
+        return counts;
+    }
+
+private:
+    struct Entry { Vec args; Data result; uint64_t hash; size_t bytes; };
+    using Index = std::unordered_multimap<uint64_t,
+        std::list<Entry>::iterator>;
+
+    Index::iterator at(Args args, uint64_t hash);
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru; Index index; // lru is most recent first
+    const size_t max_entries, max_bytes; Stats counts;
+};
+
+Memo::Index::iterator Memo::at(Args args, uint64_t hash) {
+    auto [it, end] = index.equal_range(hash);
+    for (; it != end; it++) {
+        const Vec& key = it->second->args;
+        if (std::equal(key.begin(), key.end(), args.begin(), args.end()))
+            return it;
+    }
+    return index.end();
+}
+
+bool Memo::find(Args args, uint64_t hash, Data& result) {
+    const std::lock_guard lock(mutex);
+    const auto it = at(args, hash);
+    if (it == index.end()) {
+        counts.misses++;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    result = it->second->result; counts.hits++;
+    return true;
+}
+
+void Memo::insert(Vec args, uint64_t hash, const Data& result) {
+    size_t bytes = footprint(result);
+    for (const auto& arg : args) bytes += footprint(arg);
+    if (max_entries == 0 || (max_bytes && bytes > max_bytes)) return;
+
+    const std::lock_guard lock(mutex);
+    // the fn may have been called with the same args meanwhile
+    if (at(args, hash) != index.end()) return;
+    lru.push_front({std::move(args), result, hash, bytes});
+    index.emplace(hash, lru.begin());
+    counts.entries++; counts.bytes += bytes;
+
+    while (counts.entries > max_entries ||
+        (max_bytes && counts.bytes > max_bytes)) {
+        const Entry& last = lru.back();
+        auto [it, end] = index.equal_range(last.hash);
+        while (it->second != std::prev(lru.end())) it++;
+        index.erase(it);
+        counts.entries--; counts.bytes -= last.bytes; counts.evictions++;
+        lru.pop_back();
+    }
+}
+
+// ast cache layout, in host byte order:
+//   "tnyast" version:u16 source:u64 body:u64 | symbols:u32 (len:u32 bytes)*
+//   forms
+// a form is a Data::Type byte then a NUM's f64, a SYMBOL's index into
+// the symbols, a STR's len:u32 bytes or a VEC's count:u32 forms.
+// symbol ids differ between processes, so they are stored by name
+namespace ast_cache {
+
+constexpr std::string_view MAGIC = "tnyast";
+constexpr uint16_t VERSION = 1;
+
+template <typename T> void put(std::string& out, T val) {
+    out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+void put(std::string& out, const Data& data,
+    std::unordered_map<uint32_t, uint32_t>& symbols) {
+    out += char(data.type());
+    switch (data.type()) {
+    case Data::NUM: put(out, data.num()); break;
+    case Data::SYMBOL: {
+        auto [it, _] = symbols.try_emplace(data.symbol(), symbols.size());
+        put(out, it->second);
+    } break;
+    case Data::STR:
+        put(out, uint32_t(data.str().size())); out += data.str();
+        break;
+    case Data::VEC:
+        put(out, uint32_t(data.vec().size()));
+        for (const auto& item : data.vec()) put(out, item, symbols);
+        break;
+    default: throw std::runtime_error("can't cache non ast data");
+    }
+}
+
+std::string encode(const Vec& ast, uint64_t sum) {
+    std::unordered_map<uint32_t, uint32_t> symbols; std::string forms;
+    put(forms, uint32_t(ast.size()));
+    for (const auto& form : ast) put(forms, form, symbols);
+
+    std::vector<uint32_t> order(symbols.size());
+    for (const auto& [id, index] : symbols) order[index] = id;
+    std::string body;
+    put(body, uint32_t(order.size()));
+    for (const uint32_t id : order) {
+        const std::string& name = symbol_name(id);
+        put(body, uint32_t(name.size())); body += name;
+    }
+    body += forms;
+
+    std::string out(MAGIC);
+    put(out, VERSION); put(out, sum); put(out, hash(body));
+    return out + body;
+}
+
+// reads in place, only the ast itself is allocated (from the current
+// resource). false if in is from another version or source
+bool decode(std::string_view in, uint64_t sum, Vec& ast) {
+    size_t at = 0;
+    auto bytes = [&](size_t n) {
+        if (in.size() - at < n) throw std::runtime_error("corrupt ast cache");
+        at += n;
+        return in.data() + at - n;
+    };
+    auto get = [&]<typename T>(T val) {
+        std::memcpy(&val, bytes(sizeof(T)), sizeof(T));
+        return val;
+    };
+
+    if (in.substr(0, MAGIC.size()) != MAGIC) return false;
+    bytes(MAGIC.size());
+    if (get(uint16_t()) != VERSION || get(uint64_t()) != sum) return false;
+    if (get(uint64_t()) != hash(in.substr(at))) return false;
+
+    std::vector<uint32_t> symbols(get(uint32_t()));
+    for (uint32_t& id : symbols) {
+        const uint32_t size = get(uint32_t());
+        id = intern(std::string_view(bytes(size), size));
+    }
+
+    // like parse, vecs still being filled are kept on open
+    struct Open { Vec vec; uint32_t left; };
+    std::vector<Open> open;
+    auto begin = [&] {
+        open.push_back({Vec(current_resource()), get(uint32_t())});
+        open.back().vec.reserve(std::min<size_t>(open.back().left,
+            in.size() - at)); // every form takes a byte at least
+    };
+    begin();
+    while (true) {
+        if (!open.back().left) {
+            if (open.size() == 1) break;
+            Data done(Data::VEC, std::move(open.back().vec));
+            open.pop_back(); open.back().vec.push_back(std::move(done));
+            continue;
+        }
+        open.back().left--;
+
+        Vec& into = open.back().vec;
+        switch (Data::Type(get(uint8_t()))) {
+        case Data::NUM: into.push_back({Data::NUM, get(double())}); break;
+        case Data::SYMBOL: {
+            const uint32_t index = get(uint32_t());
+            if (index >= symbols.size())
+                throw std::runtime_error("corrupt ast cache");
+            into.push_back({Data::SYMBOL, Symbol{symbols[index]}});
+        } break;
+        case Data::STR: {
+            const uint32_t size = get(uint32_t());
+            into.push_back({Data::STR, std::string(bytes(size), size)});
+        } break;
+        case Data::VEC: begin(); break;
+        default: throw std::runtime_error("corrupt ast cache");
+        }
+    }
+    if (at != in.size()) throw std::runtime_error("corrupt ast cache");
+    ast = std::move(open.front().vec);
+    return true;
+}
+
+// best effort, a cache that can't be written is just not there next time.
+// written aside and renamed so concurrent readers never see half of it
+void save(const Vec& ast, uint64_t sum, const std::string& path) {
+    const std::string out = encode(ast, sum), tmp =
+        path + ".tmp" + std::to_string(getpid());
+    if (!(std::ofstream(tmp, std::ios::binary) << out))
+        std::remove(tmp.c_str());
+    else if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        std::remove(tmp.c_str());
+}
+
+} // namespace ast_cache
+
+// ast of one script, its nodes live in arena and are freed with it
+struct Script {
+    std::pmr::monotonic_buffer_resource arena; Vec ast;
+
+    // line and col are where in starts, for the positions in errors
+    explicit Script(std::string_view in, size_t line = 1, size_t col = 1) :
+        ast(&arena) {
+        const UseResource use(&arena, true);
+        ast = parse(lex(in, line, col));
+    }
+
+    // loads the ast from cache if it was parsed from in, otherwise parses
+    // in and writes the cache for next time
+    Script(std::string_view in, const std::string& cache) : ast(&arena) {
+        const UseResource use(&arena, true);
+        const uint64_t sum = hash(in);
+        try {
+            const Mapped file(cache);
+            if (file && ast_cache::decode(file.view(), sum, ast)) return;
+        } catch (const std::runtime_error&) {} // corrupt, parse again
+        ast = parse(lex(in));
+        ast_cache::save(ast, sum, cache);
+    }
+};
+
+// splits a stream into its top level forms as soon as their parens
+// balance, reading a line at a time so a script never sits in memory
+// whole. with prompt set it asks for each line with ">>> " or "... "
+struct Reader {
+    std::istream& in; std::ostream* prompt;
+    size_t line = 1, col = 1; // where the last form starts in in
+
+    explicit Reader(std::istream& in, std::ostream* prompt = nullptr) :
+        in(in), prompt(prompt) {}
+
+    // form stays valid until the next call. an unbalanced form at the
+    // end of in still comes out so parse can report it
+    bool next(std::string_view& form) {
+        size_t i = head, depth = 0;
+        bool started = false, atom = false, string = false;
+        auto emit = [&](size_t end) {
+            form = std::string_view(pending).substr(head, end - head);
+            head = end; line = next_line; col = next_col;
+            for (const char c : form)
+                if (c == '\n') next_line++, next_col = 1;
+                else next_col++;
+            return true;
+        };
+
+        while (true) {
+            for (; i < pending.size(); i++) {
+                const char c = pending[i];
+                if (string) {
+                    if (c != '"') continue;
+                    string = false;
+                    if (!depth) return emit(i + 1);
+                    continue;
+                }
+                if (atom) {
+                    if (!space(c) && c != '(' && c != ')') continue;
+                    atom = false;
+                    if (!depth) return emit(i);
+                }
+
+                if (c == '(') depth++;
+                else if (c == ')') {
+                    if (depth <= 1) return emit(i + 1);
+                    depth--;
+                } else if (c == '"') string = true;
+                else if (!space(c)) atom = true;
+                started |= !space(c);
+            }
+
+            if (prompt) *prompt << (started ? "... " : ">>> ") << std::flush;
+            std::string line;
+            if (!std::getline(in, line)) {
+                if (started) return emit(pending.size());
+                pending.clear(); head = 0;
+                return false;
+            }
+            pending.erase(0, head); i -= head; head = 0;
+            pending += line; pending += '\n';
+        }
+    }
+
+private:
+    std::string pending; size_t head = 0; // pending is unread from head
+    size_t next_line = 1, next_col = 1; // where head is
+};
+
+// parsed and compiled once against the builtins, after which any number
+// of Envs can run it at the same time. share it as shared_ptr<const Program>
+struct Program {
+    Script script; std::shared_ptr<const vm::Chunk> chunk;
+    explicit Program(std::string_view in);
+    Program(std::string_view in, const std::string& cache); // see Script
+
+private:
+    void compile();
+};
+
+// the globals of an idle Env, say once its prelude has run, frozen for
+// any number of Envs on any threads to start from. copying a cell only
+// shares its value, so a clone costs a refcount per global and changing
+// a value it got copies that first, leaving the snapshot as it was. refs
+// change in place instead, so the globals whose fns reach one, tied, get
+// copies of those refs in the snapshot and in every clone, see untie
+struct Snapshot {
+    std::shared_ptr<const Scope> globals; std::vector<uint32_t> tied;
+    uint32_t rebinds;
+    bool tree_walk; uint32_t hot; std::pmr::memory_resource* resource;
+    explicit Snapshot(const Env& env);
+};
+
+Data exec(Args ast, Env& env);
+
+namespace vm {
+std::shared_ptr<const Chunk> compile(Args ast, Env& env,
+    const Fn* frame = nullptr, bool body = false);
+Data run(const Chunk& chunk, Env& env, bool async = false);
+void release(const Chunk& chunk, Env& env);
+bool current(const Chunk& chunk, Env& env);
+}
+
+// the slot named id in the innermost frame as it is, a ref if ref
+Data* frame_slot(uint32_t id, Env& env, bool& ref) {
+    ref = false;
+    if (env.frames.empty()) return nullptr;
+    const Frame& frame = env.frames.back();
+    const std::vector<uint32_t>& names = frame.fn->locals;
+    auto it = std::find(names.begin(), names.end(), id);
+    if (it == names.end()) return nullptr;
+    ref = frame.fn->ref(it - names.begin());
+    return &env.stack[frame.base + (it - names.begin())];
+}
+
+const Data* local(uint32_t id, Env& env) {
+    bool ref; const Data* slot = frame_slot(id, env, ref);
+    return ref ? &slot->ref() : slot;
+}
+
+// local, to assign or change in place. a worker can't change a ref, which
+// every fn sharing it would see, just as it can't assign globals
+Data* mut_local(uint32_t id, Env& env) {
+    bool ref; Data* slot = frame_slot(id, env, ref);
+    if (!ref) return slot;
+    if (env.shared)
+        throw std::runtime_error("can't change captured locals in parallel fn");
+    return &slot->mut_ref();
+}
+
+// a worker reads the globals of the Env it shares
+const Cell* global(uint32_t id, const Env& env) {
+    const Scope& scope = env.shared ? env.shared->global_scope :
+        env.global_scope;
+    const Cell* cell = scope.find(id);
+    return cell && cell->bound ? cell : nullptr;
+}
+
+const Data& lookup(uint32_t id, Env& env) {
+    if (const Data* slot = local(id, env)) return *slot;
+    if (const Cell* cell = global(id, env)) return cell->val;
+    throw std::runtime_error("undefined symbol " + symbol_name(id));
+}
+
+void define(uint32_t id, const Data& data, Env& env) {
+    if (env.shared)
+        throw std::runtime_error("can't assign globals in parallel fn");
+    Cell& cell = env.global_scope.at(id);
+    if (cell.val.type() == Data::BUILTIN) env.rebinds++;
+    cell = {data, true, cell.version + 1};
+}
+
+// what a symbol is bound to, for builtins that change it in place
+Data& binding(const Data& symbol, Env& env) {
+    if (symbol.type() != Data::SYMBOL)
+        throw std::runtime_error("can only change a symbol in place");
+    const uint32_t id = symbol.symbol();
+    if (Data* slot = mut_local(id, env)) return *slot;
+    if (env.shared)
+        throw std::runtime_error("can't assign globals in parallel fn");
+    Cell* cell = env.global_scope.find(id);
+    if (!cell || !cell->bound)
+        throw std::runtime_error("undefined symbol " + symbol_name(id));
+    return cell->val;
+}
+
+// counts a loop back edge
+void step(Env& env) {
+    if (++env.steps % Budget::CHECK_EVERY == 0 && env.budget)
+        env.budget->check();
+}
+
+// counts a fn call, before its frame is pushed
+void step_call(Env& env) {
+    step(env);
+    if (env.budget && env.frames.size() >= env.budget->depth)
+        throw BudgetExceeded("call depth exceeded");
+}
+
+// args to the fn callee are already pushed from base up
+Data invoke(const Data& callee, size_t base, Env& env) {
+    const Fn& fn = callee.fn();
+    Vec key; uint64_t sum = 0;
+    if (fn.memo) {
+        const Args args = Args(env.stack).subspan(base);
+        sum = hash(args);
+        Data result;
+        if (fn.memo->find(args, sum, result)) {
+            env.stack.resize(base);
+            return result;
+        }
+        key.assign(args.begin(), args.end());
+    }
+
+    step_call(env);
+    Data result;
+    {
+        const Profiled profiled(env, fn);
+        const Call call(env, callee, base);
+        result = env.tree_walk || !fn.chunk ||
+            !vm::current(*fn.chunk, env) ?
+            exec(fn.ast, env) : vm::run(*fn.chunk, env);
+    }
+    if (fn.chunk) vm::release(*fn.chunk, env);
+    if (fn.memo) fn.memo->insert(std::move(key), sum, result);
+    return result;
+}
+
+Data eval(const Data& data, Env& env) {
+    switch (data.type()) {
+    case Data::BUILTIN: case Data::NUM: case Data::STR: case Data::F64:
+    case Data::MAP: case Data::SET: case Data::SLICE:
+        return data;
+    case Data::SYMBOL: return lookup(data.symbol(), env);
+    case Data::VEC: {
+        const Vec& vec = data.vec();
+        if (vec.empty()) throw std::runtime_error("can't call empty vector");
+
+        Data fn = eval(vec[0], env);
+        const Args args = Args(vec).subspan(1);
+        if (fn.type() == Data::BUILTIN)
+            return call(fn.builtin(), args, env);
+        else if (fn.type() == Data::FN) {
+            if (fn.fn().params.size() != args.size())
+                throw std::runtime_error("invalid number of params in fn call");
+
+            const size_t base = env.stack.size();
+            for (const auto& arg : args) {
+                Data val = eval(arg, env);
+                env.stack.push_back(std::move(val));
+            }
+            return invoke(fn, base, env);
+        } else throw std::runtime_error("unexpected data type in call");
+    } break;
+    default: throw std::runtime_error("unknown data type in eval");
+    }
+}
+
+// calls fn with already evaluated args, builtins get them as their raw
+// args so only self evaluating values pass through unchanged
+Data apply(const Data& fn, Args vals, Env& env) {
+    if (fn.type() == Data::BUILTIN) return call(fn.builtin(), vals, env);
+    if (fn.type() != Data::FN)
+        throw std::runtime_error("unexpected data type in call");
+
+    if (fn.fn().params.size() != vals.size())
+        throw std::runtime_error("invalid number of params in fn call");
+    const size_t base = env.stack.size();
+    env.stack.insert(env.stack.end(), vals.begin(), vals.end());
+    return invoke(fn, base, env);
+}
+
+Data exec(Args ast, Env& env) {
+    if (ast.empty()) throw std::runtime_error("can't exec empty ast");
+    const UseResource use(env.resource);
+    if (!env.tree_walk) {
+        const Fn* frame = env.frames.empty() ? nullptr : env.frames.back().fn;
+        return vm::run(*vm::compile(ast, env, frame), env);
+    }
+
+    Data result;
+    for (const auto& expr : ast) result = eval(expr, env);
+    return result;
+}
+
+Data exec(const Program& program, Env& env) {
+    if (program.script.ast.empty())
+        throw std::runtime_error("can't exec empty ast");
+    // compiled against builtins env has rebound, so it is compiled again
+    if (env.tree_walk || !vm::current(*program.chunk, env))
+        return exec(program.script.ast, env);
+    const UseResource use(env.resource);
+    return vm::run(*program.chunk, env);
+}
+
+// for async builtins, which return suspend(themselves, args, env). the
+// run stops once the builtin returns, with env.suspended holding it and
+// its evaluated args, until resume is given the result of the host's
+// call. only builtins the vm calls itself, in a run by start or resume,
+// can suspend it
+Data suspend(Builtin fn, Args args, Env& env) {
+    if (env.calls != env.suspend_at || env.suspended)
+        throw std::runtime_error("async call outside of start or resume");
+    Vec vals(current_resource()); vals.reserve(args.size());
+    for (const auto& arg : args) vals.push_back(eval(arg, env));
+    env.suspended = std::make_shared<Suspended>(Suspended{fn,
+        std::move(vals)});
+    return Data();
+}
+
+// exec that can suspend, so one thread can run many scripts waiting on
+// host calls. returns the result once the script is done, or nullopt with
+// env.suspended set. to drop a suspended run instead, reset that and
+// clear env.stack and env.frames. the walker can't suspend
+std::optional<Data> start(const Program& program, Env& env) {
+    if (program.script.ast.empty())
+        throw std::runtime_error("can't exec empty ast");
+    if (env.suspended) throw std::runtime_error("env is suspended");
+    env.suspend_at = 0;
+    if (env.tree_walk) return exec(program.script.ast, env);
+    const UseResource use(env.resource);
+    const std::shared_ptr<const vm::Chunk> entry =
+        vm::current(*program.chunk, env) ? program.chunk :
+        vm::compile(program.script.ast, env);
+    Data result = vm::run(*entry, env, true);
+    if (!env.suspended) return result;
+    env.suspended->entry = entry;
+    return std::nullopt;
+}
+
+// goes on with a suspended run, result standing for the call it made
+std::optional<Data> resume(Env& env, Data result) {
+    if (!env.suspended) throw std::runtime_error("nothing to resume");
+    const std::shared_ptr<const vm::Chunk> entry = env.suspended->entry;
+    env.stack.back() = std::move(result);
+    const UseResource use(env.resource);
+    Data done = vm::run(*entry, env, true);
+    if (!env.suspended) return done;
+    env.suspended->entry = entry;
+    return std::nullopt;
+}
+
+// builds the text of a value in a buffer that goes to out in blocks,
+// walking nested values with a stack of its own so deep ones don't
+// recurse. print keeps one per thread and reuses its buffer and stack
+struct Printer {
+    static constexpr size_t BLOCK = 1 << 16;
+    struct Open { const Data* data; size_t next; }; // next child to write
+    std::string text; std::vector<Open> open;
+
+    // shortest text that reads back as the same double, whole ones that
+    // are exact in full digits so counts don't turn into 1e+05
+    void number(double x) {
+        char digits[32]; char* end;
+        if (std::trunc(x) == x && std::abs(x) < 0x1p53)
+            end = std::to_chars(digits, std::end(digits), x,
+                std::chars_format::fixed).ptr;
+        else end = std::to_chars(digits, std::end(digits), x).ptr;
+        text.append(digits, end);
+    }
+
+    void flush(std::ostream& out) {
+        out.write(text.data(), text.size()); text.clear();
+    }
+
+    void doubles(std::span<const double> xs, std::ostream& out) {
+        text += "(f64";
+        for (const double x : xs) {
+            text += ' '; number(x);
+            if (text.size() >= BLOCK) flush(out);
+        }
+        text += ')';
+    }
+
+    // writes data, or its opening and pushes it if it has children
+    void value(const Data& data, std::ostream& out) {
+        switch (data.type()) {
+        case Data::BUILTIN: {
+            text += "BUILTIN:";
+            if (const char* name = builtin::name(data.builtin())) {
+                text += name;
+                break;
+            }
+            char digits[20];
+            text += "0x"; text.append(digits, std::to_chars(digits,
+                std::end(digits), reinterpret_cast<uintptr_t>(
+                    data.builtin()), 16).ptr);
+        } break;
+
+        case Data::FN: {
+            const std::vector<uint32_t>& params = data.fn().params;
+            text += "FN:(";
+            for (auto it = params.begin(); it != params.end(); it++) {
+                if (it != params.begin()) text += ' ';
+                text += symbol_name(*it);
+            }
+            text += "){"; open.push_back({&data, 0});
+        } break;
+
+        case Data::SYMBOL: text += data.name(); break;
+        case Data::NUM: number(data.num()); break;
+        case Data::STR: text += '"'; text += data.str(); text += '"'; break;
+        case Data::F64: doubles(data.packed(), out); break;
+        case Data::VEC: text += '('; open.push_back({&data, 0}); break;
+        case Data::SLICE:
+            if (is_f64(data)) doubles(tnyvec::doubles(data), out);
+            else { text += '('; open.push_back({&data, 0}); }
+            break;
+        case Data::MAP: text += "(map"; open.push_back({&data, 0}); break;
+        case Data::SET: text += "(set"; open.push_back({&data, 0}); break;
+        default: throw std::runtime_error("unknown data type in print");
+        }
+    }
+
+    void write(const Data& root, std::ostream& out) {
+        text.clear(); open.clear();
+        value(root, out);
+        while (!open.empty()) {
+            const Data& data = *open.back().data;
+            const size_t i = open.back().next++;
+            const Data* child = nullptr; bool space = true;
+            switch (data.type()) {
+            case Data::FN:
+                if (i < data.fn().ast.size()) child = &data.fn().ast[i];
+                space = false;
+                break;
+            case Data::MAP: case Data::SET: {
+                const auto& entries = data.table().entries;
+                const bool map = data.type() == Data::MAP;
+                if (i < entries.size() * (map ? 2 : 1)) child = map ?
+                    (i % 2 ? &entries[i / 2].val : &entries[i / 2].key) :
+                    &entries[i].key;
+            } break;
+            default: // VEC and SLICE
+                if (i < items(data).size()) child = &items(data)[i];
+                space = i > 0;
+            }
+            if (!child) {
+                text += data.type() == Data::FN ? '}' : ')';
+                open.pop_back();
+                continue;
+            }
+            if (space) text += ' ';
+            value(*child, out);
+            if (text.size() >= BLOCK) flush(out);
+        }
+        flush(out);
+    }
+};
+
+void print(const Data& data, std::ostream& out = std::cout) {
+    thread_local Printer printer;
+    printer.write(data, out);
+}
+
+// symbols assigned anywhere in a fn body, outside of nested fns, get a slot
+void resolve_locals(Args ast, std::vector<uint32_t>& locals) {
+    static const uint32_t fn = intern("fn"), assign = intern("=");
+    for (const auto& data : ast) {
+        if (data.type() != Data::VEC) continue;
+        const Vec& vec = data.vec();
+        if (!vec.empty() && vec[0].type() == Data::SYMBOL) {
+            const uint32_t head = vec[0].symbol();
+            if (head == fn) continue;
+            if (head == assign) for (size_t i = 1; i < vec.size(); i += 2) {
+                if (vec[i].type() != Data::SYMBOL) continue;
+                const uint32_t id = vec[i].symbol();
+                if (std::find(locals.begin(), locals.end(), id) ==
+                    locals.end()) locals.push_back(id);
+            }
+        }
+        resolve_locals(vec, locals);
+    }
+}
+
+// every symbol in ast, nested fns included, in order of first use
+void symbols(const Vec& ast, std::vector<uint32_t>& out) {
+    for (const auto& data : ast)
+        if (data.type() == Data::VEC) symbols(data.vec(), out);
+        else if (data.type() == Data::SYMBOL &&
+            std::find(out.begin(), out.end(), data.symbol()) == out.end())
+            out.push_back(data.symbol());
+}
+
+// the fn literals in ast, not those nested in them
+void literals(Args ast, std::vector<const Vec*>& out) {
+    static const uint32_t fn = intern("fn");
+    for (const auto& data : ast) {
+        if (data.type() != Data::VEC) continue;
+        const Vec& vec = data.vec();
+        if (!vec.empty() && vec[0].type() == Data::SYMBOL &&
+            vec[0].symbol() == fn) out.push_back(&vec);
+        else literals(vec, out);
+    }
+}
+
+bool uses(Args ast, uint32_t id) {
+    for (const auto& data : ast)
+        if (data.type() == Data::VEC ? uses(data.vec(), id) :
+            data.type() == Data::SYMBOL && data.symbol() == id) return true;
+    return false;
+}
+
+// whether the fn literal (fn params body...) captures local id
+bool captures(const Vec& literal, uint32_t id) {
+    if (literal.size() < 2 || literal[1].type() != Data::VEC) return false;
+    return !uses(literal[1].vec(), id) && uses(Args(literal).subspan(2), id);
+}
+
+// how often ast assigns id or changes it in place, counting nested fns if
+// nested
+size_t writes(Args ast, uint32_t id, bool nested) {
+    static const uint32_t fn = intern("fn"), assign = intern("=");
+    static const uint32_t in_place[] = {intern("put"), intern("remove"),
+        intern("push!"), intern("set!"), intern("reserve")};
+    size_t n = 0;
+    for (const auto& data : ast) {
+        if (data.type() != Data::VEC) continue;
+        const Vec& vec = data.vec();
+        if (!vec.empty() && vec[0].type() == Data::SYMBOL) {
+            const uint32_t head = vec[0].symbol();
+            if (head == fn && !nested) continue;
+            if (head == assign) for (size_t i = 1; i < vec.size(); i += 2)
+                n += vec[i].type() == Data::SYMBOL && vec[i].symbol() == id;
+            else if (std::find(std::begin(in_place), std::end(in_place),
+                head) != std::end(in_place) && vec.size() > 1)
+                n += vec[1].type() == Data::SYMBOL && vec[1].symbol() == id;
+        }
+        n += writes(vec, id, nested);
+    }
+    return n;
+}
+
+// how the own slot of local id in body is shared with the fns literals
+// that capture it. a copy is enough if it can't change once one is made:
+// a param never assigned, or a local assigned once by a statement of
+// body that comes before them. the fn such a statement assigns to the
+// local may capture it itself, then it is BY_SELF: that fn has itself
+// in its slot instead of the nil it captured, so it frees like any other
+Fn::Slot shared(Args body, uint32_t id, bool param,
+    const std::vector<const Vec*>& fns) {
+    static const uint32_t assign = intern("=");
+    for (const Vec* fn : fns) if (writes(*fn, id, true)) return Fn::BY_REF;
+    const size_t n = writes(body, id, false);
+    if (n == 0) return Fn::BY_VALUE;
+    if (n > 1 || param) return Fn::BY_REF;
+
+    for (const auto& statement : body) {
+        std::vector<const Vec*> made;
+        literals(Args(&statement, 1), made);
+        std::erase_if(made, [&](const Vec* fn) { return !captures(*fn, id); });
+        if (!writes(Args(&statement, 1), id, false)) {
+            if (!made.empty()) return Fn::BY_REF;
+            continue;
+        }
+        const Vec& vec = statement.vec();
+        if (vec[0].type() != Data::SYMBOL || vec[0].symbol() != assign)
+            return Fn::BY_REF;
+        size_t i = 1;
+        while (i < vec.size() && !(vec[i].type() == Data::SYMBOL &&
+            vec[i].symbol() == id)) i += 2;
+        if (i + 1 >= vec.size()) return Fn::BY_REF;
+        if (made.empty()) return Fn::BY_VALUE;
+        const Data& val = vec[i + 1];
+        return made.size() == 1 && val.type() == Data::VEC &&
+            &val.vec() == made[0] ? Fn::BY_SELF : Fn::BY_REF;
+    }
+    return Fn::BY_REF;
+}
+
+// fills in fn.slots: captured slots are shared as they are in outer, and
+// own ones as far as static scoping lets them be copied, see shared
+void share(Fn& fn, const Fn* outer) {
+    std::vector<const Vec*> fns, capturing;
+    literals(fn.ast, fns);
+    if (fns.empty() && (!outer || outer->slots.empty())) return;
+
+    std::vector<Fn::Slot> slots(fn.locals.size(), Fn::BY_VALUE);
+    const size_t from = fn.params.size(), to = from + fn.captures;
+    for (size_t i = from; i < to; i++) {
+        const auto it = std::find(outer->locals.begin(), outer->locals.end(),
+            fn.locals[i]);
+        const size_t slot = it - outer->locals.begin();
+        if (slot < outer->slots.size()) slots[i] = outer->slots[slot];
+    }
+
+    for (size_t i = 0; i < fn.locals.size() && !fns.empty(); i++) {
+        if (i >= from && i < to) continue;
+        capturing.clear();
+        for (const Vec* literal : fns)
+            if (captures(*literal, fn.locals[i])) capturing.push_back(literal);
+        if (!capturing.empty())
+            slots[i] = shared(fn.ast, fn.locals[i], i < from, capturing);
+    }
+    if (std::any_of(slots.begin(), slots.end(),
+        [](Fn::Slot slot) { return slot != Fn::BY_VALUE; }))
+        fn.slots = std::move(slots);
+}
+
+// the fn of (fn params body...) made inside the frame of outer. the locals
+// of outer that its body uses are captured: they get the slots after
+// params and whoever makes the fn fills in captured, with a copy of each
+// or the ref outer shares it through, see share
+Fn make_fn(Args args, const Fn* outer, Env& env) {
+    if (args.size() < 2) throw std::runtime_error("not enough args for fn");
+
+    Fn result;
+
+    const Data& params = args[0];
+    if (params.type() != Data::VEC)
+        throw std::runtime_error("params for fn is not a vec");
+    for (const auto& data : params.vec())
+        if (data.type() != Data::SYMBOL)
+            throw std::runtime_error("param is not symbol");
+        else result.params.push_back(data.symbol());
+    result.ast.assign(args.begin() + 1, args.end());
+
+    result.locals = result.params;
+    std::vector<uint32_t> used;
+    if (outer) symbols(result.ast, used);
+    for (const uint32_t id : used)
+        if (std::find(outer->locals.begin(), outer->locals.end(), id) !=
+            outer->locals.end() && std::find(result.locals.begin(),
+            result.locals.end(), id) == result.locals.end()) {
+            result.locals.push_back(id); result.captures++;
+        }
+    resolve_locals(result.ast, result.locals);
+    share(result, outer);
+    if (!env.tree_walk)
+        result.chunk = vm::compile(result.ast, env, &result, true);
+    return result;
+}
+
+// runs parallel loops on a fixed set of threads plus the caller. every
+// slot starts with an even share of the loop, takes pieces off its front
+// and once it runs dry steals the back half of another slot's share
+struct ThreadPool {
+    explicit ThreadPool(size_t threads) : ranges(new Range[threads + 1]) {
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back([this, i] { serve(i); });
+    }
+    ~ThreadPool() {
+        { const std::lock_guard lock(mutex); stop = true; }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    // body(begin, end, slot) runs over pieces of [0, n), with slot below
+    // size(). the first error is rethrown once every slot has stopped and
+    // loops started from inside a body run on the calling thread
+    void for_each(size_t n,
+        const std::function<void(size_t, size_t, size_t)>& body) {
+
+        if (n == 0) return;
+        if (inside || size() == 1) { body(0, n, 0); return; }
+
+        const std::lock_guard job(running_job);
+        for (size_t i = 0; i < size(); i++) {
+            ranges[i].begin = n * i / size();
+            ranges[i].end = n * (i + 1) / size();
+        }
+        {
+            const std::lock_guard lock(mutex);
+            this->body = &body; grain = std::max<size_t>(1, n / size() / 8);
+            error = nullptr; failed = false;
+            running = workers.size(); generation++;
+        }
+        wake.notify_all();
+
+        inside = true; work(size() - 1); inside = false;
+        std::unique_lock lock(mutex);
+        done.wait(lock, [this] { return running == 0; });
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    struct Range { std::mutex mutex; size_t begin = 0, end = 0; };
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Range[]> ranges;
+    std::mutex mutex, running_job; std::condition_variable wake, done;
+    const std::function<void(size_t, size_t, size_t)>* body = nullptr;
+    size_t grain = 1, generation = 0, running = 0; bool stop = false;
+    std::exception_ptr error; std::atomic<bool> failed = false;
+    static thread_local inline bool inside = false;
+
+    void serve(size_t slot) {
+        inside = true;
+        for (size_t seen = 0;;) {
+            {
+                std::unique_lock lock(mutex);
+                wake.wait(lock, [&] { return stop || generation != seen; });
+                if (stop) return;
+                seen = generation;
+            }
+            work(slot);
+            const std::lock_guard lock(mutex);
+            if (--running == 0) done.notify_all();
+        }
+    }
+
+    void work(size_t slot) {
+        size_t begin, end;
+        while (!failed && take(slot, begin, end)) {
+            try {
+                (*body)(begin, end, slot);
+            } catch (...) {
+                const std::lock_guard lock(mutex);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    }
+
+    // only one range is locked at a time
+    bool take(size_t slot, size_t& begin, size_t& end) {
+        Range& own = ranges[slot];
+        for (size_t i = 0; i < size(); i++) {
+            if (i > 0) {
+                Range& victim = ranges[(slot + i) % size()];
+                size_t from, to;
+                {
+                    const std::lock_guard lock(victim.mutex);
+                    if (victim.begin >= victim.end) continue;
+                    from = victim.begin + (victim.end - victim.begin) / 2;
+                    to = victim.end; victim.end = from;
+                }
+                const std::lock_guard lock(own.mutex);
+                own.begin = from; own.end = to;
+            }
+            const std::lock_guard lock(own.mutex);
+            if (own.begin < own.end) {
+                begin = own.begin; end = std::min(own.end, begin + grain);
+                own.begin = end;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// started on first use, with a thread per core besides the caller or
+// as many slots in total as TNYVEC_THREADS says
+ThreadPool& thread_pool() {
+    static ThreadPool pool([] {
+        const char* threads = std::getenv("TNYVEC_THREADS");
+        const long n = threads ? std::atol(threads) :
+            std::thread::hardware_concurrency();
+        return std::max(1l, n) - 1;
+    }());
+    return pool;
+}
+
+// reductions run in LANES separate accumulators that are only combined at
+// the end, the vector kernels work on the same lanes as the scalar loop,
+// so results don't depend on which instruction set ran them
+namespace simd {
+
+constexpr size_t LANES = 16;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+bool avx2() {
+    static const bool has = __builtin_cpu_supports("avx2");
+    return has;
+}
+
+#define SIMD_REDUCE_KERNEL(NAME, AVX2, NEON) \
+[[gnu::target("avx2")]] size_t NAME##_kernel(const double* xs, \
+    const double* ys, size_t n, double* lanes) { \
+    __m256d accs[LANES / 4]; \
+    for (size_t j = 0; j < LANES / 4; j++) \
+        accs[j] = _mm256_loadu_pd(lanes + 4 * j); \
+    size_t i = 0; \
+    for (; i + LANES <= n; i += LANES) \
+        for (size_t j = 0; j < LANES / 4; j++) { \
+            const __m256d acc = accs[j], \
+                x = _mm256_loadu_pd(xs + i + 4 * j); \
+            [[maybe_unused]] const __m256d y = \
+                _mm256_loadu_pd(ys + i + 4 * j); \
+            accs[j] = AVX2; \
+        } \
+    for (size_t j = 0; j < LANES / 4; j++) \
+        _mm256_storeu_pd(lanes + 4 * j, accs[j]); \
+    return i; \
+}
+
+#define SIMD_MAP_KERNEL(NAME, AVX2, NEON) \
+[[gnu::target("avx2")]] size_t NAME##_kernel(const double* xs, \
+    const double* ys, double* out, size_t n) { \
+    size_t i = 0; \
+    for (; i + 4 <= n; i += 4) { \
+        const __m256d x = _mm256_loadu_pd(xs + i), \
+            y = _mm256_loadu_pd(ys + i); \
+        _mm256_storeu_pd(out + i, AVX2); \
+    } \
+    return i; \
+}
+
+#define SIMD_KERNEL(NAME, ARGS) if (avx2()) i = NAME##_kernel ARGS
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_REDUCE_KERNEL(NAME, AVX2, NEON) \
+size_t NAME##_kernel(const double* xs, const double* ys, size_t n, \
+    double* lanes) { \
+    float64x2_t accs[LANES / 2]; \
+    for (size_t j = 0; j < LANES / 2; j++) \
+        accs[j] = vld1q_f64(lanes + 2 * j); \
+    size_t i = 0; \
+    for (; i + LANES <= n; i += LANES) \
+        for (size_t j = 0; j < LANES / 2; j++) { \
+            const float64x2_t acc = accs[j], x = vld1q_f64(xs + i + 2 * j); \
+            [[maybe_unused]] const float64x2_t y = \
+                vld1q_f64(ys + i + 2 * j); \
+            accs[j] = NEON; \
+        } \
+    for (size_t j = 0; j < LANES / 2; j++) \
+        vst1q_f64(lanes + 2 * j, accs[j]); \
+    return i; \
+}
+
+#define SIMD_MAP_KERNEL(NAME, AVX2, NEON) \
+size_t NAME##_kernel(const double* xs, const double* ys, double* out, \
+    size_t n) { \
+    size_t i = 0; \
+    for (; i + 2 <= n; i += 2) { \
+        const float64x2_t x = vld1q_f64(xs + i), y = vld1q_f64(ys + i); \
+        vst1q_f64(out + i, NEON); \
+    } \
+    return i; \
+}
+
+#define SIMD_KERNEL(NAME, ARGS) i = NAME##_kernel ARGS
+
+#else
+#define SIMD_REDUCE_KERNEL(NAME, AVX2, NEON)
+#define SIMD_MAP_KERNEL(NAME, AVX2, NEON)
+#define SIMD_KERNEL(NAME, ARGS)
+#endif
+
+// lane starts at INIT, SCALAR and the kernels fold x (and y) into acc,
+// COMBINE merges lanes a and b
+#define SIMD_REDUCE(NAME, INIT, SCALAR, COMBINE, AVX2, NEON) \
+SIMD_REDUCE_KERNEL(NAME, AVX2, NEON) \
+double NAME(const double* xs, const double* ys, size_t n) { \
+    double lanes[LANES]; \
+    std::fill(lanes, lanes + LANES, INIT); \
+    size_t i = 0; \
+    SIMD_KERNEL(NAME, (xs, ys, n, lanes)); \
+    for (; i < n; i++) { \
+        const double acc = lanes[i % LANES], x = xs[i]; \
+        [[maybe_unused]] const double y = ys[i]; \
+        lanes[i % LANES] = SCALAR; \
+    } \
+    for (size_t w = LANES / 2; w > 0; w /= 2) \
+        for (size_t j = 0; j < w; j++) { \
+            const double a = lanes[j], b = lanes[j + w]; \
+            lanes[j] = COMBINE; \
+        } \
+    return lanes[0]; \
+}
+
+#define SIMD_MAP(NAME, OPERATION, AVX2, NEON) \
+SIMD_MAP_KERNEL(NAME, AVX2, NEON) \
+void NAME(const double* xs, const double* ys, double* out, size_t n) { \
+    size_t i = 0; \
+    SIMD_KERNEL(NAME, (xs, ys, out, n)); \
+    for (; i < n; i++) out[i] = xs[i] OPERATION ys[i]; \
+}
+
+constexpr double INF = std::numeric_limits<double>::infinity();
+
+SIMD_REDUCE(sum, 0.0, acc + x, a + b,
+    _mm256_add_pd(acc, x), vaddq_f64(acc, x))
+SIMD_REDUCE(dot, 0.0, acc + x * y, a + b,
+    _mm256_add_pd(acc, _mm256_mul_pd(x, y)), vaddq_f64(acc, vmulq_f64(x, y)))
+// nans are skipped
+SIMD_REDUCE(min, INF, x < acc ? x : acc, b < a ? b : a,
+    _mm256_min_pd(x, acc), vbslq_f64(vcltq_f64(x, acc), x, acc))
+SIMD_REDUCE(max, -INF, x > acc ? x : acc, b > a ? b : a,
+    _mm256_max_pd(x, acc), vbslq_f64(vcgtq_f64(x, acc), x, acc))
+
+SIMD_MAP(add, +, _mm256_add_pd(x, y), vaddq_f64(x, y))
+SIMD_MAP(mul, *, _mm256_mul_pd(x, y), vmulq_f64(x, y))
+
+} // namespace simd
+
+namespace builtin {
+
+#define ARITHMETIC_OPERATION(FN_NAME, OPERATION) \
+Data FN_NAME(Args args, Env& env) { \
+    if (args.size() < 2) \
+        throw std::runtime_error("not enough args for " \
+            + std::string(#FN_NAME)); \
+    Data data = eval(args[0], env); \
+    if (data.type() != Data::NUM) \
+        throw std::runtime_error("invalid argument for " \
+            + std::string(#FN_NAME)); \
+    double result = data.num(); \
+    for (auto it = args.begin() + 1; it != args.end(); it++) { \
+        if ((data = eval(*it, env)).type() != Data::NUM) \
+            throw std::runtime_error("invalid argument for " \
+                + std::string(#FN_NAME)); \
+        result OPERATION data.num(); \
+    } \
+    return {Data::NUM, result}; \
+}
+
+ARITHMETIC_OPERATION(sum, +=)
+ARITHMETIC_OPERATION(sub, -=)
+ARITHMETIC_OPERATION(mul, *=)
+ARITHMETIC_OPERATION(div, /=)
+
+#define RELATIONAL_OPERATION(FN_NAME, OPERATION) \
+Data FN_NAME(Args args, Env& env) { \
+    if (args.size() != 2) \
+        throw std::runtime_error("invalid number of args for " \
+            + std::string(#FN_NAME)); \
+    const Data lhs = eval(args[0], env); \
+    if (lhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid lhs argument for " \
+            + std::string(#FN_NAME)); \
+    const double lhs_val = lhs.num(); \
+    const Data rhs = eval(args[1], env); \
+    if (rhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid rhs argument for " \
+            + std::string(#FN_NAME)); \
+    const double rhs_val = rhs.num(); \
+    return {Data::NUM, double(lhs_val OPERATION rhs_val)}; \
+}
+
+RELATIONAL_OPERATION(lt, <)
+RELATIONAL_OPERATION(gt, >)
+RELATIONAL_OPERATION(lteq, <=)
+RELATIONAL_OPERATION(gteq, >=)
+
+Data eq(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for eq");
+    const Data lhs = eval(args[0], env);
+    const Data rhs = eval(args[1], env);
+    return {Data::NUM, double(lhs == rhs)};
+}
+
+#define LOGICAL_OPERATION(FN_NAME, OPERATION) \
+Data FN_NAME(Args args, Env& env) { \
+    if (args.size() != 2) \
+        throw std::runtime_error("invalid number of args for " \
+            + std::string(#FN_NAME)); \
+    const Data lhs = eval(args[0], env); \
+    const Data rhs = eval(args[1], env); \
+    return {Data::NUM, double(bool(lhs) OPERATION bool(rhs))}; \
+}
+
+LOGICAL_OPERATION(land, &&)
+LOGICAL_OPERATION(lor, ||)
+
+Data lnot(Args args, Env& env) {
+    if (args.size() != 1)
+        throw std::runtime_error("invalid number of args for lnot");
+    const Data rhs = eval(args[0], env);
+    if (rhs.type() != Data::NUM)
+        std::runtime_error("invalid argument for lnot");
+    return {Data::NUM, double(!bool(rhs))};
+}
+
+Data cond_if(Args args, Env& env) {
+    if (args.size() != 3)
+        throw std::runtime_error("invalid number of args for cond_if");
+
+    Data condition = eval(args[0], env);
+    if (condition) return eval(args[1], env);
+    else return eval(args[2], env);
+}
+
+Data when(Args args, Env& env) {
+    if (args.size() < 2)
+        throw std::runtime_error("invalid number of args for when");
+
+    Data condition = eval(args[0], env);
+
+    Data result;
+    if (condition) result = exec(args.subspan(1), env);
+    return result;
+}
+
+Data loop_while(Args args, Env& env) {
+    if (args.size() < 2)
+        throw std::runtime_error("invalid number of args for loop_while");
+
+    const Data& condition = args[0];
+    const Args ast = args.subspan(1);
+
+    Data result;
+    while (eval(condition, env)) { result = exec(ast, env); step(env); }
+    return result;
+}
+
+Data loop_for(Args args, Env& env) {
+    if (args.size() < 4)
+        throw std::runtime_error("invalid number of args for loop_for");
+
+    eval(args[0], env); // initial
+    const Data& condition = args[1], & increment = args[2];
+    const Args ast = args.subspan(3);
+
+    Data result;
+    while (eval(condition, env)) {
+        result = exec(ast, env);
+        eval(increment, env); step(env);
+    }
+    return result;
+}
+
+Data assign(Args args, Env& env) {
+    if (args.size() < 2 && args.size() % 2 == 0)
+        throw std::runtime_error("invalid number of args for assign");
+
+    static auto add_to_scope = [](uint32_t id, Data data,
+        Env& env) -> Data {
+
+        if (data.type() == Data::FN && data.fn().name == Fn::ANONYMOUS)
+            data.mut_fn().name = id;
+        if (Data* slot = mut_local(id, env)) *slot = data;
+        else define(id, data, env);
+        return data;
+    };
+
+    Data result;
+    for (auto it = args.begin(); it != args.end(); it += 2) {
+        if (it->type() != Data::SYMBOL)
+            throw std::runtime_error("lhs in assign is not symbol");
+        result = add_to_scope(
+            it->symbol(), eval(*(it + 1), env), env
+        );
+    }
+    return result;
+}
+
+Data fn(Args args, Env& env) {
+    const Fn* outer = env.frames.empty() ? nullptr : env.frames.back().fn;
+    Fn result = make_fn(args, outer, env);
+    bool ref;
+    for (uint32_t i = 0; i < result.captures; i++)
+        result.captured.push_back(*frame_slot(
+            result.locals[result.params.size() + i], env, ref));
+    return {Data::FN, std::move(result)};
+}
+
+Data f64(Args args, Env& env) {
+    Packed result(current_resource());
+    for (const auto& arg : args) {
+        const Data data = eval(arg, env);
+        if (data.type() == Data::NUM) result.push_back(data.num());
+        else if (is_f64(data))
+            result.insert(result.end(), doubles(data).begin(),
+                doubles(data).end());
+        else throw std::runtime_error("invalid argument for f64");
+    }
+    return {Data::F64, std::move(result)};
+}
+
+// (vrange end) or (vrange begin end), counting up by 1
+Data vrange(Args args, Env& env) {
+    if (args.size() != 1 && args.size() != 2)
+        throw std::runtime_error("invalid number of args for vrange");
+    const Data lhs = eval(args[0], env);
+    const Data rhs = args.size() == 2 ? eval(args[1], env) : lhs;
+    if (lhs.type() != Data::NUM || rhs.type() != Data::NUM ||
+        !std::isfinite(lhs.num()) || !std::isfinite(rhs.num()))
+        throw std::runtime_error("invalid argument for vrange");
+
+    const double begin = args.size() == 2 ? lhs.num() : 0, end = rhs.num();
+    Packed result(current_resource());
+    if (end > begin) result.reserve(std::ceil(end - begin));
+    for (double x = begin; x < end; x++) result.push_back(x);
+    return {Data::F64, std::move(result)};
+}
+
+Data packed(const Data& arg, Env& env, const std::string& fn_name) {
+    Data data = eval(arg, env);
+    if (!is_f64(data))
+        throw std::runtime_error("invalid argument for " + fn_name);
+    return data;
+}
+
+Data reduce(Args args, Env& env, const std::string& fn_name,
+    double (*kernel)(const double*, const double*, size_t), bool empty) {
+
+    if (args.size() != 1)
+        throw std::runtime_error("invalid number of args for " + fn_name);
+    const Data data = packed(args[0], env, fn_name);
+    const auto xs = doubles(data);
+    if (xs.empty() && !empty)
+        throw std::runtime_error("empty vector for " + fn_name);
+    return {Data::NUM, kernel(xs.data(), xs.data(), xs.size())};
+}
+
+Data vsum(Args args, Env& env) {
+    return reduce(args, env, "vsum", simd::sum, true);
+}
+Data vmin(Args args, Env& env) {
+    return reduce(args, env, "vmin", simd::min, false);
+}
+Data vmax(Args args, Env& env) {
+    return reduce(args, env, "vmax", simd::max, false);
+}
+
+Data vdot(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for vdot");
+    const Data lhs = packed(args[0], env, "vdot");
+    const Data rhs = packed(args[1], env, "vdot");
+    const auto xs = doubles(lhs), ys = doubles(rhs);
+    if (xs.size() != ys.size())
+        throw std::runtime_error("vectors of different length for vdot");
+    return {Data::NUM, simd::dot(xs.data(), ys.data(), xs.size())};
+}
+
+// a num on either side is spread over the length of the other vector
+Data elementwise(Args args, Env& env, const std::string& fn_name,
+    void (*kernel)(const double*, const double*, double*, size_t)) {
+
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for " + fn_name);
+    const Data lhs = eval(args[0], env);
+    const Data rhs = eval(args[1], env);
+    if (!is_f64(lhs) && !is_f64(rhs))
+        throw std::runtime_error("invalid argument for " + fn_name);
+    const size_t n = doubles(is_f64(lhs) ? lhs : rhs).size();
+
+    Packed lhs_fill(current_resource()), rhs_fill(current_resource());
+    auto operand = [&](const Data& data, Packed& fill) {
+        if (data.type() == Data::NUM) fill.assign(n, data.num());
+        else if (!is_f64(data))
+            throw std::runtime_error("invalid argument for " + fn_name);
+        else if (doubles(data).size() != n)
+            throw std::runtime_error("vectors of different length for " +
+                fn_name);
+        return data.type() == Data::NUM ? fill.data() : doubles(data).data();
+    };
+    const double* xs = operand(lhs, lhs_fill);
+    const double* ys = operand(rhs, rhs_fill);
+
+    Packed result(n, current_resource());
+    kernel(xs, ys, result.data(), n);
+    return {Data::F64, std::move(result)};
+}
+
+Data vadd(Args args, Env& env) {
+    return elementwise(args, env, "v+", simd::add);
+}
+Data vmul(Args args, Env& env) {
+    return elementwise(args, env, "v*", simd::mul);
+}
+
+Data vmap(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for vmap");
+    const Data fn = eval(args[0], env);
+    const Data data = packed(args[1], env, "vmap");
+
+    Packed result(current_resource()); result.reserve(doubles(data).size());
+    for (const double x : doubles(data)) {
+        const Data arg = {Data::NUM, x};
+        const Data val = apply(fn, Args(&arg, 1), env);
+        if (val.type() != Data::NUM)
+            throw std::runtime_error("fn for vmap didn't return a num");
+        result.push_back(val.num());
+    }
+    return {Data::F64, std::move(result)};
+}
+
+// body runs on the thread pool with a worker Env per slot, which has its
+// own stack but reads the globals of env, so fns run there must be pure,
+// and makes values through env's resource behind a lock, see locked
+void parallel(Env& env, size_t n,
+    const std::function<void(size_t, Env&)>& body) {
+
+    ThreadPool& threads = thread_pool();
+    std::vector<Env> workers;
+    workers.reserve(threads.size());
+    for (size_t i = 0; i < threads.size(); i++) workers.emplace_back(&env);
+
+    threads.for_each(n, [&](size_t begin, size_t end, size_t slot) {
+        Env& worker = workers[slot];
+        const UseResource use(worker.resource);
+        for (size_t i = begin; i < end; i++) body(i, worker);
+    });
+}
+
+// (pmap fn v) calls fn on every element of v in parallel
+Data pmap(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for pmap");
+    const Data fn = eval(args[0], env);
+    const Data data = eval(args[1], env);
+
+    if (is_f64(data)) {
+        const auto xs = doubles(data);
+        Packed result(xs.size(), current_resource());
+        parallel(env, xs.size(), [&](size_t i, Env& worker) {
+            const Data arg = {Data::NUM, xs[i]};
+            const Data val = apply(fn, Args(&arg, 1), worker);
+            if (val.type() != Data::NUM)
+                throw std::runtime_error("fn for pmap didn't return a num");
+            result[i] = val.num();
+        });
+        return {Data::F64, std::move(result)};
+    } else if (is_vec(data)) {
+        const Args vec = items(data);
+        Vec result(vec.size(), current_resource());
+        parallel(env, vec.size(), [&](size_t i, Env& worker) {
+            result[i] = apply(fn, Args(&vec[i], 1), worker);
+        });
+        return {Data::VEC, std::move(result)};
+    } else throw std::runtime_error("invalid argument for pmap");
+}
+
+// (pfor n fn) calls fn on 0 up to n in parallel
+Data pfor(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for pfor");
+    const Data count = eval(args[0], env);
+    if (count.type() != Data::NUM || !(count.num() >= 0) ||
+        !std::isfinite(count.num()))
+        throw std::runtime_error("invalid argument for pfor");
+    const Data fn = eval(args[1], env);
+
+    parallel(env, std::ceil(count.num()), [&](size_t i, Env& worker) {
+        const Data arg = {Data::NUM, double(i)};
+        apply(fn, Args(&arg, 1), worker);
+    });
+    return {};
+}
+
+// (preduce fn init v) folds fixed blocks of v in parallel and then the
+// block results into init in order, so fn has to be associative. the
+// blocks don't depend on the number of threads, neither does the result
+Data preduce(Args args, Env& env) {
+    if (args.size() != 3)
+        throw std::runtime_error("invalid number of args for preduce");
+    const Data fn = eval(args[0], env);
+    Data result = eval(args[1], env);
+    const Data data = eval(args[2], env);
+    if (!is_f64(data) && !is_vec(data))
+        throw std::runtime_error("invalid argument for preduce");
+
+    const bool f64 = is_f64(data);
+    const size_t n = f64 ? doubles(data).size() : items(data).size();
+    auto element = [&](size_t i) -> Data {
+        if (f64) return {Data::NUM, doubles(data)[i]};
+        return items(data)[i];
+    };
+
+    static constexpr size_t BLOCK = 256;
+    Vec blocks((n + BLOCK - 1) / BLOCK, current_resource());
+    parallel(env, blocks.size(), [&](size_t block, Env& worker) {
+        Data vals[2] = {element(block * BLOCK)};
+        for (size_t i = block * BLOCK + 1; i < std::min(n, (block + 1) * BLOCK);
+            i++) {
+            vals[1] = element(i);
+            vals[0] = apply(fn, vals, worker);
+        }
+        blocks[block] = std::move(vals[0]);
+    });
+
+    for (auto& block : blocks) {
+        Data vals[2] = {std::move(result), std::move(block)};
+        result = apply(fn, vals, env);
+    }
+    return result;
+}
+
+// (memo fn entries bytes) is fn with its results cached by args, entries
+// defaults to 4096 and bytes to no limit, see Memo
+Data memo(Args args, Env& env) {
+    if (args.empty() || args.size() > 3)
+        throw std::runtime_error("invalid number of args for memo");
+    Data fn = eval(args[0], env);
+    if (fn.type() != Data::FN)
+        throw std::runtime_error("memo of something other than a fn");
+
+    size_t bounds[2] = {4096, 0};
+    for (size_t i = 1; i < args.size(); i++) {
+        const Data bound = eval(args[i], env);
+        if (bound.type() != Data::NUM || !(bound.num() >= 0) ||
+            !std::isfinite(bound.num()))
+            throw std::runtime_error("invalid bound for memo");
+        bounds[i - 1] = bound.num();
+    }
+    fn.mut_fn().memo = std::make_shared<Memo>(bounds[0], bounds[1]);
+    return fn;
+}
+
+// (map k v...) and (set x...) hash what they hold by hash(Data), so a
+// lookup costs about the same however many entries there are
+Data map(Args args, Env& env) {
+    if (args.size() % 2 != 0)
+        throw std::runtime_error("invalid number of args for map");
+    Table result(current_resource());
+    for (size_t i = 0; i < args.size(); i += 2) {
+        const Data key = eval(args[i], env);
+        Data val = eval(args[i + 1], env);
+        result.put(key) = std::move(val);
+    }
+    return {Data::MAP, std::move(result)};
+}
+
+Data set(Args args, Env& env) {
+    Table result(current_resource());
+    for (const auto& arg : args) result.put(eval(arg, env));
+    return {Data::SET, std::move(result)};
+}
+
+const Table& table_of(const Data& data, const char* name) {
+    if (data.type() != Data::MAP && data.type() != Data::SET)
+        throw std::runtime_error(std::string("invalid argument for ") + name);
+    return data.table();
+}
+
+// (get m k default) is the val of k in map m, or default (nil if not given)
+Data get(Args args, Env& env) {
+    if (args.size() != 2 && args.size() != 3)
+        throw std::runtime_error("invalid number of args for get");
+    const Data data = eval(args[0], env);
+    if (data.type() != Data::MAP)
+        throw std::runtime_error("invalid argument for get");
+    const Data key = eval(args[1], env);
+    if (const Data* val = data.table().find(key)) return *val;
+    return args.size() == 3 ? eval(args[2], env) : Data();
+}
+
+// (contains m k) of a map or a set
+Data contains(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for contains");
+    const Data data = eval(args[0], env);
+    const Data key = eval(args[1], env);
+    return {Data::NUM, double(table_of(data, "contains").find(key) != nullptr)};
+}
+
+// (put m k v) sets k to v in the map bound to m and (put s x) adds x to
+// the set bound to s, in place. both return what was put
+Data put(Args args, Env& env) {
+    if (args.size() != 2 && args.size() != 3)
+        throw std::runtime_error("invalid number of args for put");
+    Data key = eval(args[1], env);
+    Data val = args.size() == 3 ? eval(args[2], env) : Data();
+    Data& bound = binding(args[0], env);
+    const Data::Type type = args.size() == 3 ? Data::MAP : Data::SET;
+    if (bound.type() != type)
+        throw std::runtime_error("invalid argument for put");
+    Data& slot = bound.mut_table().put(key);
+    if (type == Data::SET) return key;
+    slot = val;
+    return val;
+}
+
+// (remove m k) takes k out of the map or set bound to m, in place. 1 if
+// it was there
+Data remove(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for remove");
+    const Data key = eval(args[1], env);
+    Data& bound = binding(args[0], env);
+    table_of(bound, "remove");
+    return {Data::NUM, double(bound.mut_table().remove(key))};
+}
+
+// (keys m) of a map or a set as a vec, in the order of its entries
+Data keys(Args args, Env& env) {
+    if (args.size() != 1)
+        throw std::runtime_error("invalid number of args for keys");
+    const Data data = eval(args[0], env);
+    Vec result(current_resource());
+    for (const auto& entry : table_of(data, "keys").entries)
+        result.push_back(entry.key);
+    return {Data::VEC, std::move(result)};
+}
+
+// (vec x...) of the values of its args
+Data vec(Args args, Env& env) {
+    Vec result(current_resource()); result.reserve(args.size());
+    for (const auto& arg : args) result.push_back(eval(arg, env));
+    return {Data::VEC, std::move(result)};
+}
+
+// a whole num below end
+size_t index(const Data& data, size_t end, const char* fn_name) {
+    if (data.type() != Data::NUM || !(data.num() >= 0) ||
+        !(data.num() < end) || data.num() != std::floor(data.num()))
+        throw std::runtime_error(std::string("invalid index for ") + fn_name);
+    return data.num();
+}
+
+size_t size(const Data& data, const char* fn_name) {
+    if (is_f64(data)) return doubles(data).size();
+    if (is_vec(data)) return items(data).size();
+    throw std::runtime_error(std::string("invalid argument for ") + fn_name);
+}
+
+// (len v) of a vec, f64 vector, slice, str, map or set
+Data len(Args args, Env& env) {
+    if (args.size() != 1)
+        throw std::runtime_error("invalid number of args for len");
+    const Data data = eval(args[0], env);
+    switch (data.type()) {
+    case Data::STR: return {Data::NUM, double(data.str().size())};
+    case Data::MAP: case Data::SET:
+        return {Data::NUM, double(data.table().size())};
+    default: return {Data::NUM, double(size(data, "len"))};
+    }
+}
+
+// (nth v i) is element i of v, counting from 0
+Data nth(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for nth");
+    const Data data = eval(args[0], env);
+    const size_t i = index(eval(args[1], env), size(data, "nth"), "nth");
+    if (is_f64(data)) return {Data::NUM, doubles(data)[i]};
+    return items(data)[i];
+}
+
+// (slice v begin end) views v from begin up to end, which defaults to the
+// length of v, without copying it. a slice of a slice views the original
+Data slice(Args args, Env& env) {
+    if (args.size() != 2 && args.size() != 3)
+        throw std::runtime_error("invalid number of args for slice");
+    const Data data = eval(args[0], env);
+    const size_t n = size(data, "slice");
+    const size_t begin = index(eval(args[1], env), n + 1, "slice");
+    const size_t end = args.size() == 3 ?
+        index(eval(args[2], env), n + 1, "slice") : n;
+    if (end < begin) throw std::runtime_error("invalid index for slice");
+
+    if (data.type() != Data::SLICE)
+        return {Data::SLICE, Slice{data, begin, end - begin}};
+    const Slice& of = data.slice();
+    return {Data::SLICE, Slice{of.of, of.begin + begin, end - begin}};
+}
+
+// the vec or f64 vector bound to symbol, which the builtins below change
+// in place. other copies of it keep what it was, see Data::mut_vec
+Data& bound_vector(const Data& symbol, Env& env, const char* fn_name) {
+    Data& bound = binding(symbol, env);
+    if (bound.type() != Data::VEC && bound.type() != Data::F64)
+        throw std::runtime_error(std::string("invalid argument for ") +
+            fn_name);
+    return bound;
+}
+
+double num(const Data& data, const char* fn_name) {
+    if (data.type() != Data::NUM)
+        throw std::runtime_error(std::string("invalid argument for ") +
+            fn_name);
+    return data.num();
+}
+
+// (push! v x) appends x to v and returns it
+Data push(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for push!");
+    Data val = eval(args[1], env);
+    Data& bound = bound_vector(args[0], env, "push!");
+    if (bound.type() == Data::F64)
+        bound.mut_packed().push_back(num(val, "push!"));
+    else bound.mut_vec().push_back(val);
+    return val;
+}
+
+// (set! v i x) sets element i of v to x and returns it
+Data set_nth(Args args, Env& env) {
+    if (args.size() != 3)
+        throw std::runtime_error("invalid number of args for set!");
+    const Data at = eval(args[1], env);
+    Data val = eval(args[2], env);
+    Data& bound = bound_vector(args[0], env, "set!");
+    const size_t i = index(at, size(bound, "set!"), "set!");
+    if (bound.type() == Data::F64) bound.mut_packed()[i] = num(val, "set!");
+    else bound.mut_vec()[i] = val;
+    return val;
+}
+
+// (reserve v n) makes room for n elements in v, so pushing up to there
+// doesn't move it
+Data reserve(Args args, Env& env) {
+    if (args.size() != 2)
+        throw std::runtime_error("invalid number of args for reserve");
+    const Data n = eval(args[1], env);
+    if (n.type() != Data::NUM || !(n.num() >= 0) || !std::isfinite(n.num()))
+        throw std::runtime_error("invalid argument for reserve");
+    Data& bound = bound_vector(args[0], env, "reserve");
+    if (bound.type() == Data::F64) bound.mut_packed().reserve(n.num());
+    else bound.mut_vec().reserve(n.num());
+    return n;
+}
+
+// the id of a builtin is its index here, so new ones go at the end
+#define BUILTINS(X) \
+    X(SUM, "+", sum) X(SUB, "-", sub) X(MUL, "*", mul) X(DIV, "/", div) \
+    X(LT, "<", lt) X(GT, ">", gt) X(LTEQ, "<=", lteq) X(GTEQ, ">=", gteq) \
+    X(EQ, "==", eq) X(LAND, "&&", land) X(LOR, "||", lor) X(LNOT, "!", lnot) \
+    X(IF, "if", cond_if) X(WHEN, "when", when) X(WHILE, "while", loop_while) \
+    X(FOR, "for", loop_for) X(ASSIGN, "=", assign) X(FN, "fn", fn) \
+    X(F64, "f64", f64) X(VRANGE, "vrange", vrange) X(VSUM, "vsum", vsum) \
+    X(VMIN, "vmin", vmin) X(VMAX, "vmax", vmax) X(VDOT, "vdot", vdot) \
+    X(VADD, "v+", vadd) X(VMUL, "v*", vmul) X(VMAP, "vmap", vmap) \
+    X(PMAP, "pmap", pmap) X(PFOR, "pfor", pfor) X(PREDUCE, "preduce", preduce) \
+    X(MEMO, "memo", memo) X(MAP, "map", map) X(SET, "set", set) \
+    X(GET, "get", get) X(CONTAINS, "contains", contains) X(PUT, "put", put) \
+    X(REMOVE, "remove", remove) X(KEYS, "keys", keys) X(VEC, "vec", vec) \
+    X(LEN, "len", len) X(NTH, "nth", nth) X(SLICE, "slice", slice) \
+    X(PUSH, "push!", push) X(SET_NTH, "set!", set_nth) \
+    X(RESERVE, "reserve", reserve)
+
+enum Id : uint8_t {
+#define X(ID, NAME, FN_NAME) ID,
+    BUILTINS(X)
+#undef X
+    NONE // not registered, e.g. a host builtin
+};
+
+struct Entry { const char* name; Builtin fn; };
+const Entry table[] = {
+#define X(ID, NAME, FN_NAME) {NAME, FN_NAME},
+    BUILTINS(X)
+#undef X
+};
+
+Id id(Builtin fn) {
+    for (size_t i = 0; i < std::size(table); i++)
+        if (table[i].fn == fn) return Id(i);
+    return NONE;
+}
+
+const char* name(Builtin fn) {
+    const Id i = id(fn);
+    return i == NONE ? nullptr : table[i].name;
 }
 
 } // namespace builtin
 
+namespace vm {
+
+#define VM_OPCODES(X) \
+    X(CONST) X(LOAD_LOCAL) X(STORE_LOCAL) X(LOAD_GLOBAL) X(STORE_GLOBAL) \
+    X(POP) X(JUMP) X(JUMP_IF_NOT) X(LOOP) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(LT) X(GT) X(LTEQ) X(GTEQ) \
+    X(ADD_K) X(SUB_K) X(MUL_K) X(DIV_K) \
+    X(LT_K) X(GT_K) X(LTEQ_K) X(GTEQ_K) X(EQ) X(LAND) X(LOR) X(LNOT) \
+    X(LOAD_REF) X(STORE_REF) X(CLOSURE) X(BUILTIN) X(CALL_BEGIN) \
+    X(CALL_GLOBAL) X(CALL) X(TAIL_CALL) X(FAIL) X(RET)
+
+enum Op : uint32_t {
+#define X(OP) OP,
+    VM_OPCODES(X)
+#undef X
+};
+
+// a, b and c are const indices, jump targets, counts or symbol ids
+// depending on op.
+// the _K ops take their rhs from a numeric const instead of the stack,
+// LOAD_REF and STORE_REF go through the ref in slot a, see Fn::slots,
+// LOOP is a JUMP back that counts as a step, CLOSURE makes a fn at site b
+// from the const a and the slots it captures on top of the stack and
+// CALL_GLOBAL at site a checks the callee in global c, going on at b
+// after a builtin
+struct Instr { Op op; uint32_t a = 0, b = 0, c = 0; };
+
+// heat counts calls and back edges into a chunk until it is hot, see
+// Env::hot, then it is compiled once to native, which stays null if it
+// can't be, and heat stays TRIED.
+// slot is where Envs keep the Sites of the chunk, which a new chunk gets
+// once this one is gone, so they grow with the chunks alive at once
+struct Chunk {
+    static constexpr uint32_t TRIED = -1;
+    Chunk();
+    ~Chunk();
+    Chunk(const Chunk&) = delete;
+    std::vector<Instr> code; Vec consts;
+    uint32_t closures = 0; // CLOSURE ops, their sites count up from 0
+    std::vector<uint32_t> calls; // the args const of each CALL_GLOBAL site
+    // the globals whose builtins it runs inline, see current
+    std::vector<std::pair<uint32_t, Builtin>> cores;
+    uint32_t slot; uint64_t serial; // serial is unique to the chunk
+    uint32_t frame = 0; // slots of the fn it is the body of
+    mutable std::atomic<uint32_t> heat = 0;
+    mutable std::once_flag once; mutable std::unique_ptr<Native> owned;
+    mutable std::atomic<const Native*> native = nullptr;
+};
+
+// the native tier. a chunk of only numeric ops on its own frame compiles
+// to x86-64 that works on the bits of the stack in place, each operand at
+// a depth known when compiling. every value it meets is a num or nil, so
+// none needs releasing, and at anything else, a nil operand, a budget
+// check, FAIL or RET, it returns that instr for the vm to go on from with
+// the stack as the vm would have it there
+struct Native {
+    static constexpr uint32_t NONE = -1;
+    using Entry = uint32_t (*)(uint64_t* slots, uint64_t* steps, uint32_t at);
+    Entry entry = nullptr; size_t size = 0;
+    uint32_t frame = 0, most = 0; // slots and the most operands
+    std::vector<uint32_t> depth; // operands before each instr, or NONE
+
+    Native() = default;
+    Native(const Native&) = delete;
+    ~Native() { if (entry) munmap(reinterpret_cast<void*>(entry), size); }
+
+    static bool unboxed(const Data& data) {
+        return data.bits < Data::TAG_MIN || data.bits == Data::NIL;
+    }
+
+    // NONE, without running, unless the frame holds only nums and nil
+    uint32_t run(Vec& stack, size_t slots, uint32_t at, uint64_t& steps)
+        const {
+        if (at >= depth.size() || stack.size() - slots != frame + depth[at] ||
+            !std::all_of(stack.begin() + slots, stack.end(), unboxed))
+            return NONE;
+        stack.resize(slots + frame + most);
+        const uint32_t to = entry(
+            reinterpret_cast<uint64_t*>(stack.data() + slots), &steps, at);
+        stack.resize(slots + frame + depth[to]);
+        return to;
+    }
+
+    static std::unique_ptr<Native> compile(const Chunk& chunk);
+};
+
+std::unique_ptr<Native> Native::compile(const Chunk& chunk) {
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32)
+    const std::vector<Instr>& code = chunk.code;
+    const Data* consts = chunk.consts.data();
+    const uint32_t n = code.size();
+    static_assert(std::has_single_bit(Budget::CHECK_EVERY));
+    if (!std::all_of(code.begin(), code.end(), [](const Instr& in) {
+        return (in.op <= LNOT && in.op != LOAD_GLOBAL &&
+            in.op != STORE_GLOBAL) || in.op == FAIL || in.op == RET;
+    })) return nullptr;
+    auto native = std::make_unique<Native>(); native->frame = chunk.frame;
+    std::vector<uint32_t>& depth = native->depth; depth.assign(n, NONE);
+
+    // operand depth and which operands are surely nums before each instr,
+    // agreeing along every way into it
+    std::vector<uint64_t> known(n); std::vector<bool> entries(n);
+    std::vector<uint32_t> work;
+    auto flow = [&](uint32_t to, uint32_t d, uint64_t k) {
+        if (to >= n || d >= 64) return false;
+        k &= (uint64_t(1) << d) - 1;
+        if (depth[to] == NONE) depth[to] = d, known[to] = k;
+        else if (depth[to] != d) return false;
+        else if ((known[to] & k) == known[to]) return true;
+        else known[to] &= k;
+        work.push_back(to);
+        return true;
+    };
+    auto num = [&](uint32_t k) { return consts[k].type() == Data::NUM; };
+    flow(0, 0, 0); entries[0] = true;
+    while (!work.empty()) {
+        const uint32_t i = work.back(); work.pop_back();
+        const Instr& in = code[i]; const uint32_t d = depth[i];
+        const uint64_t k = known[i], top = uint64_t(1) << d;
+        bool ok = true;
+        switch (in.op) {
+        case CONST:
+            ok = unboxed(consts[in.a]) &&
+                flow(i + 1, d + 1, num(in.a) ? k | top : k);
+            break;
+        case LOAD_LOCAL:
+            ok = in.a < chunk.frame && flow(i + 1, d + 1, k | top); break;
+        case STORE_LOCAL:
+            ok = in.a < chunk.frame && d > 0 && flow(i + 1, d, k); break;
+        case POP: ok = d > 0 && flow(i + 1, d - 1, k); break;
+        case JUMP: ok = flow(in.a, d, k); break;
+        case JUMP_IF_NOT:
+            ok = d > 0 && flow(in.a, d - 1, k) && flow(i + 1, d - 1, k);
+            break;
+        case LOOP:
+            // the vm can enter at a loop head with operands it pushed
+            // unchecked, so none is known there
+            ok = flow(in.a, d, 0); entries[in.a] = true;
+            break;
+        case ADD: case SUB: case MUL: case DIV: case LT: case GT:
+        case LTEQ: case GTEQ: case EQ: case LAND: case LOR:
+            ok = d > 1 && flow(i + 1, d - 1, k | top >> 2); break;
+        case ADD_K: case SUB_K: case MUL_K: case DIV_K: case LT_K:
+        case GT_K: case LTEQ_K: case GTEQ_K:
+            ok = num(in.a) && d > 0 && flow(i + 1, d, k | top >> 1); break;
+        case LNOT: ok = d > 0 && flow(i + 1, d, k | top >> 1); break;
+        case FAIL: break;
+        case RET: ok = d > 0; break;
+        default: ok = false;
+        }
+        if (!ok) return nullptr;
+    }
+    for (const uint32_t d : depth)
+        if (d != NONE) native->most = std::max(native->most, d + 1);
+
+    // rbx holds the slots, r12 the lowest bits that aren't a num and r13
+    // the steps. rel32 fixups go to the code of an instr or its exit
+    std::vector<uint8_t> out;
+    auto put = [&](std::initializer_list<uint8_t> bytes) {
+        out.insert(out.end(), bytes);
+    };
+    auto imm = [&](uint64_t bits, int size) {
+        for (int i = 0; i < size; i++) out.push_back(bits >> 8 * i);
+    };
+    std::vector<std::pair<size_t, uint32_t>> to_instr, to_exit, to_end;
+    auto rel = [&](std::vector<std::pair<size_t, uint32_t>>& fixups,
+        uint32_t target) { fixups.push_back({out.size(), target}); imm(0, 4); };
+    auto slot = [&](uint32_t j) { return 8 * j; };
+    auto operand = [&](uint32_t j) { return 8 * (chunk.frame + j); };
+    auto load_rax = [&](uint32_t disp) {
+        put({0x48, 0x8B, 0x83}); imm(disp, 4);
+    };
+    auto store_rax = [&](uint32_t disp) {
+        put({0x48, 0x89, 0x83}); imm(disp, 4);
+    };
+    auto rax_bits = [&](uint64_t bits) { put({0x48, 0xB8}); imm(bits, 8); };
+    auto load_xmm = [&](uint8_t r, uint32_t disp) {
+        put({0xF2, 0x0F, 0x10, uint8_t(0x83 | r << 3)}); imm(disp, 4);
+    };
+    auto xmm_bits = [&](uint8_t r, uint64_t bits) {
+        rax_bits(bits); put({0x66, 0x48, 0x0F, 0x6E, uint8_t(0xC0 | r << 3)});
+    };
+    auto store_xmm0 = [&](uint32_t disp) {
+        put({0xF2, 0x0F, 0x11, 0x83}); imm(disp, 4);
+    };
+    auto leave = [&](uint32_t i) {
+        put({0xB8}); imm(i, 4); put({0xE9}); rel(to_end, 0);
+    };
+    // exits at i unless the operand at depth j is a num
+    auto check = [&](uint32_t i, uint32_t j) {
+        if (known[i] >> j & 1) return;
+        load_rax(operand(j));
+        put({0x4C, 0x39, 0xE0, 0x0F, 0x83}); rel(to_exit, i);
+    };
+    // lhs to xmm0 and rhs to xmm1, from operands or the const of a _K op
+    auto operands = [&](uint32_t i) {
+        const Instr& in = code[i]; const uint32_t d = depth[i];
+        if (in.op >= ADD_K && in.op <= GTEQ_K) {
+            check(i, d - 1); load_xmm(0, operand(d - 1));
+            xmm_bits(1, consts[in.a].bits);
+            return d - 1;
+        }
+        check(i, d - 2); check(i, d - 1);
+        load_xmm(0, operand(d - 2)); load_xmm(1, operand(d - 1));
+        return d - 2;
+    };
+    // al to 0 or 1 at operand j
+    auto boolean = [&](uint32_t j) {
+        put({0x0F, 0xB6, 0xC0, 0xF2, 0x0F, 0x2A, 0xC0}); store_xmm0(operand(j));
+    };
+
+    put({0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF5,
+        0x49, 0xBC});
+    imm(Data::TAG_MIN, 8);
+    for (uint32_t i = 0; i < n; i++)
+        if (entries[i] && depth[i] != NONE) {
+            put({0x81, 0xFA}); imm(i, 4); put({0x0F, 0x84}); rel(to_instr, i);
+        }
+    put({0x89, 0xD0, 0xE9}); rel(to_end, 0);
+
+    std::vector<size_t> labels(n);
+    for (uint32_t i = 0; i < n; i++) {
+        const Instr& in = code[i]; const uint32_t d = depth[i];
+        labels[i] = out.size();
+        if (d == NONE) continue;
+        switch (in.op) {
+        case CONST:
+            rax_bits(consts[in.a].bits); store_rax(operand(d)); break;
+        case LOAD_LOCAL:
+            load_rax(slot(in.a));
+            put({0x4C, 0x39, 0xE0, 0x0F, 0x83}); rel(to_exit, i);
+            store_rax(operand(d));
+            break;
+        case STORE_LOCAL:
+            load_rax(operand(d - 1)); store_rax(slot(in.a)); break;
+        case POP: break;
+        case JUMP: put({0xE9}); rel(to_instr, in.a); break;
+        case JUMP_IF_NOT:
+            // nil is the only other value and is false, NaN is true
+            load_rax(operand(d - 1));
+            if (!(known[i] >> (d - 1) & 1)) {
+                put({0x4C, 0x39, 0xE0, 0x0F, 0x83}); rel(to_instr, in.a);
+            }
+            put({0x66, 0x48, 0x0F, 0x6E, 0xC0, 0x66, 0x0F, 0x57, 0xC9,
+                0x66, 0x0F, 0x2E, 0xC1, 0x7A, 0x06, 0x0F, 0x84});
+            rel(to_instr, in.a);
+            break;
+        case LOOP:
+            // back to the vm every CHECK_EVERY steps, which takes the
+            // step itself and checks the budget before coming back
+            put({0x49, 0xFF, 0x45, 0x00, 0x49, 0xF7, 0x45, 0x00});
+            imm(Budget::CHECK_EVERY - 1, 4);
+            put({0x0F, 0x85}); rel(to_instr, in.a);
+            put({0x49, 0xFF, 0x4D, 0x00}); leave(i);
+            break;
+        case ADD: case SUB: case MUL: case DIV:
+        case ADD_K: case SUB_K: case MUL_K: case DIV_K: {
+            static constexpr uint8_t ops[] = {0x58, 0x5C, 0x59, 0x5E};
+            const uint32_t j = operands(i);
+            put({0xF2, 0x0F, ops[(in.op - (in.op >= ADD_K ? ADD_K : ADD))],
+                0xC1});
+            // the nan x86 makes would read as a tagged value
+            put({0x66, 0x0F, 0x2E, 0xC0, 0x7B, 0x0F});
+            xmm_bits(0, Data::NAN_BITS); store_xmm0(operand(j));
+        } break;
+        case LT: case GT: case LTEQ: case GTEQ:
+        case LT_K: case GT_K: case LTEQ_K: case GTEQ_K: {
+            const uint32_t j = operands(i);
+            const int rel_op = in.op - (in.op >= LT_K ? LT_K : LT);
+            // ucomisd with the operands swapped for < and <=, then seta
+            // or setae, both false when unordered
+            put({0x66, 0x0F, 0x2E, uint8_t(rel_op % 2 ? 0xC1 : 0xC8)});
+            put({0x0F, uint8_t(rel_op < 2 ? 0x97 : 0x93), 0xC0});
+            boolean(j);
+        } break;
+        case EQ:
+            operands(i);
+            put({0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1,
+                0x20, 0xC8});
+            boolean(d - 2);
+            break;
+        case LAND: case LOR:
+            operands(i);
+            put({0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xC2, 0x0F, 0x95,
+                0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8, 0x66, 0x0F, 0x2E, 0xCA,
+                0x0F, 0x95, 0xC1, 0x0F, 0x9A, 0xC2, 0x08, 0xD1,
+                uint8_t(in.op == LAND ? 0x20 : 0x08), 0xC8});
+            boolean(d - 2);
+            break;
+        case LNOT:
+            check(i, d - 1); load_xmm(0, operand(d - 1));
+            put({0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xC2, 0x0F, 0x94,
+                0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8});
+            boolean(d - 1);
+            break;
+        default: leave(i); // FAIL and RET
+        }
+    }
+
+    std::vector<size_t> exits(n, 0);
+    for (const auto& [at, i] : to_exit)
+        if (!exits[i]) exits[i] = out.size(), leave(i);
+    const size_t end = out.size();
+    put({0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+    auto patch = [&](size_t at, size_t target) {
+        const uint32_t offset = target - (at + 4);
+        std::memcpy(out.data() + at, &offset, 4);
+    };
+    for (const auto& [at, i] : to_instr) patch(at, labels[i]);
+    for (const auto& [at, i] : to_exit) patch(at, exits[i]);
+    for (const auto& [at, i] : to_end) patch(at, end);
+
+    void* mem = mmap(nullptr, out.size(), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return nullptr;
+    std::memcpy(mem, out.data(), out.size());
+    if (mprotect(mem, out.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, out.size());
+        return nullptr;
+    }
+    native->entry = reinterpret_cast<Entry>(mem); native->size = out.size();
+    return native;
+#else
+    (void)chunk;
+    return nullptr;
+#endif
+}
+
+// counts a call or back edge into chunk at at, compiling it once it is
+// hot for env, and from then on runs it natively whenever the frame
+// allows. returns the instr the vm goes on from, or nullptr if it goes
+// on at at
+const Instr* tier(const Chunk& chunk, uint32_t at, size_t slots, Env& env) {
+    if (env.hot == Env::NEVER) return nullptr;
+    const Native* native = chunk.native.load(std::memory_order_acquire);
+    if (!native) {
+        // racy counts between threads only delay the compile a little
+        const uint32_t heat = chunk.heat.load(std::memory_order_relaxed);
+        if (heat == Chunk::TRIED) return nullptr;
+        if (heat < env.hot) {
+            chunk.heat.store(heat + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        std::call_once(chunk.once, [&] {
+            chunk.owned = Native::compile(chunk);
+            chunk.native.store(chunk.owned.get(), std::memory_order_release);
+        });
+        chunk.heat.store(Chunk::TRIED, std::memory_order_relaxed);
+        native = chunk.native.load(std::memory_order_acquire);
+        if (!native) return nullptr;
+    }
+    const uint32_t to = native->run(env.stack, slots, at, env.steps);
+    return to == Native::NONE ? nullptr : chunk.code.data() + to;
+}
+
+// the slots of chunks alive, see Chunk
+struct Slots {
+    std::mutex mutex; std::vector<uint32_t> free;
+    uint32_t next = 0; uint64_t serial = 0;
+};
+Slots& slots() {
+    static Slots slots;
+    return slots;
+}
+
+Chunk::Chunk() {
+    Slots& all = slots();
+    const std::lock_guard lock(all.mutex);
+    serial = ++all.serial;
+    if (all.free.empty()) slot = all.next++;
+    else { slot = all.free.back(); all.free.pop_back(); }
+}
+
+Chunk::~Chunk() {
+    Slots& all = slots();
+    const std::lock_guard lock(all.mutex);
+    all.free.push_back(slot);
+}
+
+// the Sites of chunk in env, reset if they were an earlier chunk's. valid
+// until env.sites grows, so run doesn't hold on to them across calls
+Sites& sites(const Chunk& chunk, Env& env) {
+    if (chunk.slot >= env.sites.size()) env.sites.resize(chunk.slot + 1);
+    Sites& sites = env.sites[chunk.slot];
+    if (sites.serial != chunk.serial) {
+        sites.serial = chunk.serial;
+        sites.closures.assign(chunk.closures, Data());
+        sites.calls.assign(chunk.calls.size(), {});
+        sites.cores.assign(chunk.cores.size(), {});
+    }
+    return sites;
+}
+
+// whether the builtins chunk runs inline are still what env binds their
+// symbols to. true until env rebinds a builtin, then each cell is checked
+// as CALL_GLOBAL checks its callee, again only once a define has bumped
+// its version. a chunk that isn't current is compiled again each time it
+// runs, see invoke. may grow env.sites
+bool current(const Chunk& chunk, Env& env) {
+    if (env.rebinds == 0 || chunk.cores.empty()) return true;
+    Sites& here = sites(chunk, env);
+    for (size_t i = 0; i < chunk.cores.size(); i++) {
+        const auto [id, fn] = chunk.cores[i];
+        const Cell* cell = global(id, env);
+        if (!cell) return false;
+        Sites::Callee& cached = here.cores[i];
+        if (cached.version == 0 || cell->version != cached.version)
+            cached = {cell->version, cell->val.type() == Data::BUILTIN &&
+                cell->val.builtin() == fn};
+        if (!cached.builtin) return false;
+    }
+    return true;
+}
+
+struct Compiler {
+    Env& env; const Fn* frame; Chunk& chunk;
+    // assigned at the top level of the chunk, so never bound at compile time
+    std::vector<uint32_t> assigned;
+
+    uint32_t constant(const Data& data) {
+        chunk.consts.push_back(data);
+        return chunk.consts.size() - 1;
+    }
+
+    size_t emit(Op op, uint32_t a = 0, uint32_t b = 0, uint32_t c = 0) {
+        chunk.code.push_back({op, a, b, c});
+        return chunk.code.size() - 1;
+    }
+
+    uint32_t here() const { return chunk.code.size(); }
+
+    int slot(const Data& symbol) const {
+        if (!frame) return -1;
+        const std::vector<uint32_t>& locals = frame->locals;
+        auto it = std::find(locals.begin(), locals.end(), symbol.symbol());
+        return it == locals.end() ? -1 : it - locals.begin();
+    }
+
+    void load(const Data& symbol) {
+        if (const int i = slot(symbol); i >= 0)
+            emit(frame->ref(i) ? LOAD_REF : LOAD_LOCAL, i);
+        else emit(LOAD_GLOBAL, symbol.symbol());
+    }
+
+    void store(const Data& symbol) {
+        if (const int i = slot(symbol); i >= 0)
+            emit(frame->ref(i) ? STORE_REF : STORE_LOCAL, i);
+        else emit(STORE_GLOBAL, symbol.symbol());
+    }
+
+    // an fn literal assigned right away is named after the symbol
+    void name(const Data& symbol) {
+        if (chunk.code.empty() || (chunk.code.back().op != CONST &&
+            chunk.code.back().op != CLOSURE)) return;
+        Data& val = chunk.consts[chunk.code.back().a];
+        if (val.type() == Data::FN && val.fn().name == Fn::ANONYMOUS)
+            val.mut_fn().name = symbol.symbol();
+    }
+
+    // core forms are bound at compile time unless shadowed by a local,
+    // only by their own names and while the chunk doesn't assign them
+    Builtin core(const Data& head) {
+        if (head.type() != Data::SYMBOL || slot(head) >= 0) return nullptr;
+        const uint32_t id = head.symbol();
+        if (std::find(assigned.begin(), assigned.end(), id) !=
+            assigned.end()) return nullptr;
+
+        const Cell* cell = global(id, env);
+        if (!cell || cell->val.type() != Data::BUILTIN) return nullptr;
+        const Builtin fn = cell->val.builtin();
+        const char* name = builtin::name(fn);
+        if (!name || symbol_name(id) != name) return nullptr;
+        const std::pair<uint32_t, Builtin> core = {id, fn};
+        if (std::find(chunk.cores.begin(), chunk.cores.end(), core) ==
+            chunk.cores.end()) chunk.cores.push_back(core);
+        return fn;
+    }
+
+    void seq(Args exprs, bool tail = false) {
+        for (auto it = exprs.begin(); it != exprs.end(); it++) {
+            if (it != exprs.begin()) emit(POP);
+            expr(*it, tail && it == exprs.end() - 1);
+        }
+    }
+
+    // calls to pure core forms whose args fold are run now through the
+    // builtin itself, anything it would throw on is left for the runtime.
+    // core records each builtin folded, so the result is dropped with the
+    // chunk once one of them is rebound, see current
+    bool fold(const Data& data, Data& result) {
+        if (data.type() == Data::NUM || data.type() == Data::STR) {
+            result = data;
+            return true;
+        }
+        if (data.type() != Data::VEC || data.vec().empty()) return false;
+
+        // the builtins up to lnot are pure
+        const Vec& vec = data.vec();
+        const Builtin native = core(vec[0]);
+        if (!native || builtin::id(native) > builtin::LNOT) return false;
+
+        Vec args;
+        for (size_t i = 1; i < vec.size(); i++)
+            if (!fold(vec[i], args.emplace_back())) return false;
+        try {
+            result = native(args, env);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+        return true;
+    }
+
+    bool fold_num(const Data& data, Data& result) {
+        return fold(data, result) && result.type() == Data::NUM;
+    }
+
+    void expr(const Data& data, bool tail = false) {
+        Data folded;
+        switch (data.type()) {
+        case Data::SYMBOL: load(data); break;
+        case Data::VEC:
+            if (fold(data, folded)) emit(CONST, constant(folded));
+            else call(data.vec(), tail);
+            break;
+        default: emit(CONST, constant(data));
+        }
+    }
+
+    // rhs is a numeric const, lhs is whatever is on the stack
+    void operand(const Data& rhs, Op op, Op op_k) {
+        Data folded;
+        if (fold_num(rhs, folded)) emit(op_k, constant(folded));
+        else { expr(rhs); emit(op); }
+    }
+
+    void call(const Vec& vec, bool tail) {
+        if (vec.empty()) {
+            emit(FAIL, constant({Data::STR, "can't call empty vector"}));
+            return;
+        }
+        const size_t argc = vec.size() - 1;
+        const Builtin native = core(vec[0]);
+        const builtin::Id id = native ? builtin::id(native) : builtin::NONE;
+
+        // indexed by id, starting at sum and eq
+        static const Op numeric[][2] = {
+            {ADD, ADD_K}, {SUB, SUB_K}, {MUL, MUL_K}, {DIV, DIV_K},
+            {LT, LT_K}, {GT, GT_K}, {LTEQ, LTEQ_K}, {GTEQ, GTEQ_K}
+        };
+        static const Op binary[] = {EQ, LAND, LOR};
+
+        switch (id) {
+        case builtin::SUM: case builtin::SUB: case builtin::MUL:
+        case builtin::DIV: {
+            if (argc < 2) break;
+            const auto [op, op_k] = numeric[id - builtin::SUM];
+            expr(vec[1]);
+            for (size_t i = 2; i < vec.size(); i++) operand(vec[i], op, op_k);
+        } return;
+        case builtin::LT: case builtin::GT: case builtin::LTEQ:
+        case builtin::GTEQ: {
+            if (argc != 2) break;
+            const auto [op, op_k] = numeric[id - builtin::SUM];
+            expr(vec[1]); operand(vec[2], op, op_k);
+        } return;
+        case builtin::EQ: case builtin::LAND: case builtin::LOR:
+            if (argc != 2) break;
+            expr(vec[1]); expr(vec[2]); emit(binary[id - builtin::EQ]);
+            return;
+        case builtin::LNOT:
+            if (argc != 1) break;
+            expr(vec[1]); emit(LNOT);
+            return;
+        case builtin::IF: {
+            if (argc != 3) break;
+            expr(vec[1]); const size_t to_else = emit(JUMP_IF_NOT);
+            expr(vec[2], tail); const size_t to_end = emit(JUMP);
+            chunk.code[to_else].a = here(); expr(vec[3], tail);
+            chunk.code[to_end].a = here();
+        } return;
+        case builtin::WHEN: {
+            if (argc < 2) break;
+            expr(vec[1]); const size_t to_else = emit(JUMP_IF_NOT);
+            seq(Args(vec).subspan(2), tail); const size_t to_end = emit(JUMP);
+            chunk.code[to_else].a = here(); emit(CONST, constant(Data()));
+            chunk.code[to_end].a = here();
+        } return;
+        case builtin::WHILE: {
+            if (argc < 2) break;
+            emit(CONST, constant(Data()));
+            const uint32_t top = here(); expr(vec[1]);
+            const size_t to_end = emit(JUMP_IF_NOT);
+            emit(POP); seq(Args(vec).subspan(2)); emit(LOOP, top);
+            chunk.code[to_end].a = here();
+        } return;
+        case builtin::FOR: {
+            if (argc < 4) break;
+            expr(vec[1]); emit(POP); emit(CONST, constant(Data()));
+            const uint32_t top = here(); expr(vec[2]);
+            const size_t to_end = emit(JUMP_IF_NOT);
+            emit(POP); seq(Args(vec).subspan(4));
+            expr(vec[3]); emit(POP); emit(LOOP, top);
+            chunk.code[to_end].a = here();
+        } return;
+        case builtin::FN: {
+            // a literal that captures nothing is made only once
+            Fn fn;
+            try {
+                fn = make_fn(Args(vec).subspan(1), frame, env);
+            } catch (const std::runtime_error&) {
+                break;
+            }
+            // refs are captured as they are, not what they hold
+            for (uint32_t i = 0; i < fn.captures; i++)
+                emit(LOAD_LOCAL, slot({Data::SYMBOL,
+                    Symbol{fn.locals[fn.params.size() + i]}}));
+            const bool captures = fn.captures;
+            const uint32_t k = constant({Data::FN, std::move(fn)});
+            if (captures) emit(CLOSURE, k, chunk.closures++);
+            else emit(CONST, k);
+        } return;
+        case builtin::ASSIGN:
+            if (argc < 2 || argc % 2 != 0 || !assignable(vec)) break;
+            for (size_t i = 1; i < vec.size(); i += 2) {
+                if (i > 1) emit(POP);
+                expr(vec[i + 1]); name(vec[i]); store(vec[i]);
+            }
+            return;
+        default: break;
+        }
+
+        // anything else keeps builtin semantics: builtins get raw args
+        const Data args = {Data::VEC, Vec(vec.begin() + 1, vec.end())};
+        if (native) {
+            emit(BUILTIN, constant({Data::BUILTIN, native}), constant(args));
+            return;
+        }
+        // a global callee is loaded and checked by one op
+        size_t begin;
+        if (vec[0].type() == Data::SYMBOL && slot(vec[0]) < 0) {
+            chunk.calls.push_back(constant(args));
+            begin = emit(CALL_GLOBAL, chunk.calls.size() - 1, 0,
+                vec[0].symbol());
+        } else { expr(vec[0]); begin = emit(CALL_BEGIN, constant(args)); }
+        for (size_t i = 1; i < vec.size(); i++) expr(vec[i]);
+        emit(tail ? TAIL_CALL : CALL, argc);
+        chunk.code[begin].b = here();
+    }
+
+    static bool assignable(const Vec& vec) {
+        for (size_t i = 1; i < vec.size(); i += 2)
+            if (vec[i].type() != Data::SYMBOL) return false;
+        return true;
+    }
+};
+
+// a fn body makes calls in tail position reuse the frame of the fn
+std::shared_ptr<const Chunk> compile(Args ast, Env& env, const Fn* frame,
+    bool body) {
+
+    auto chunk = std::make_shared<Chunk>();
+    if (frame) chunk->frame = frame->locals.size();
+    Compiler compiler{env, frame, *chunk};
+    if (!frame) resolve_locals(ast, compiler.assigned);
+    compiler.seq(ast, body);
+    compiler.emit(RET);
+    return chunk;
+}
+
+// for fns made by the walker, only this copy gets the chunk
+void compile(Data& fn, Env& env) {
+    Fn& callee = fn.mut_fn();
+    callee.chunk = compile(callee.ast, env, &callee, true);
+}
+
+// the closures an Env keeps for chunk, if it ran it
+Vec* closures(const Chunk& chunk, Env& env) {
+    if (chunk.slot >= env.sites.size() ||
+        env.sites[chunk.slot].serial != chunk.serial) return nullptr;
+    return &env.sites[chunk.slot].closures;
+}
+
+// once the frame of chunk is gone, the closures it left in its sites
+// let go of what they captured, or changing that in place would copy it,
+// and of their chunk, which would otherwise outlive chunk with them
+void release(const Chunk& chunk, Env& env) {
+    if (chunk.slot >= env.sites.size() ||
+        env.sites[chunk.slot].serial != chunk.serial) return;
+    for (Data& closure : env.sites[chunk.slot].closures)
+        if (closure.type() == Data::FN && !closure.shared()) {
+            Fn& fn = closure.mut_fn();
+            fn.captured.clear(); fn.chunk.reset();
+        }
+}
+
+#if defined(__GNUC__)
+#define VM_OP(OP) op_##OP
+#define VM_DISPATCH() goto *labels[ip->op]
+#else
+#define VM_OP(OP) case OP
+#define VM_DISPATCH() goto dispatch
+#endif
+#define VM_NEXT() do { ++ip; VM_DISPATCH(); } while (0)
+#define VM_JUMP(TARGET) do { ip = code + (TARGET); VM_DISPATCH(); } while (0)
+// for calls and back edges, which go on natively once chunk is, see tier
+#define VM_TIER(TARGET) do { \
+    ip = code + (TARGET); \
+    if (const Instr* to = tier(*chunk, ip - code, slots, env)) ip = to; \
+    VM_DISPATCH(); \
+} while (0)
+
+// a builtin the vm calls itself, the only kind that can suspend an async
+// run, which then goes on at NEXT once resumed
+#define VM_BUILTIN(FN, ARGS, NEXT) do { \
+    env.suspend_at = async ? env.calls + 1 : 0; \
+    Data result = tnyvec::call(FN, ARGS, env); \
+    stack.push_back(std::move(result)); ip = (NEXT); here = nullptr; \
+    if (env.suspended) { \
+        Suspended& suspended = *env.suspended; \
+        suspended.chunk = chunk; suspended.ip = ip; \
+        suspended.base = unwind.base; suspended.depth = depth; \
+        suspended.profiled = unwind.profiled; unwind.keep = true; \
+        return Data(); \
+    } \
+    VM_DISPATCH(); \
+} while (0)
+
+#define VM_ARITHMETIC(OP, FN_NAME, OPERATION) \
+VM_OP(OP): { \
+    Data& lhs = stack[stack.size() - 2]; const Data& rhs = stack.back(); \
+    if (lhs.type() != Data::NUM || rhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid argument for " #FN_NAME); \
+    double result = lhs.num(); result OPERATION rhs.num(); \
+    lhs = {Data::NUM, result}; stack.pop_back(); \
+} VM_NEXT();
+
+#define VM_RELATIONAL(OP, FN_NAME, OPERATION) \
+VM_OP(OP): { \
+    Data& lhs = stack[stack.size() - 2]; const Data& rhs = stack.back(); \
+    if (lhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid lhs argument for " #FN_NAME); \
+    if (rhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid rhs argument for " #FN_NAME); \
+    const double result = \
+        lhs.num() OPERATION rhs.num(); \
+    lhs = {Data::NUM, result}; stack.pop_back(); \
+} VM_NEXT();
+
+#define VM_ARITHMETIC_K(OP, FN_NAME, OPERATION) \
+VM_OP(OP): { \
+    Data& lhs = stack.back(); \
+    if (lhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid argument for " #FN_NAME); \
+    double result = lhs.num(); result OPERATION consts[ip->a].num(); \
+    lhs = {Data::NUM, result}; \
+} VM_NEXT();
+
+#define VM_RELATIONAL_K(OP, FN_NAME, OPERATION) \
+VM_OP(OP): { \
+    Data& lhs = stack.back(); \
+    if (lhs.type() != Data::NUM) \
+        throw std::runtime_error("invalid lhs argument for " #FN_NAME); \
+    const double result = lhs.num() OPERATION consts[ip->a].num(); \
+    lhs = {Data::NUM, result}; \
+} VM_NEXT();
+
+#define VM_LOGICAL(OP, OPERATION) \
+VM_OP(OP): { \
+    Data& lhs = stack[stack.size() - 2]; \
+    const double result = bool(lhs) OPERATION bool(stack.back()); \
+    lhs = {Data::NUM, result}; stack.pop_back(); \
+} VM_NEXT();
+
+// calls between fns stay inside one run: a CALL pushes a Frame that
+// remembers the caller and RET resumes it, so only builtins that call
+// back into the vm nest run on the c++ stack
+// an async run, from start or resume, can stop at a builtin that calls
+// suspend, leaving its stack and frames for resume to go on with
+Data run(const Chunk& entry, Env& env, bool async) {
+    Vec& stack = env.stack;
+    const std::shared_ptr<Suspended> from =
+        async ? std::move(env.suspended) : nullptr;
+    const size_t depth = from ? from->depth : env.frames.size();
+    struct Unwind {
+        Env& env; const size_t base, depth, profiled; bool keep = false;
+        ~Unwind() {
+            if (keep) return;
+            env.frames.resize(depth);
+            env.stack.erase(env.stack.begin() + base, env.stack.end());
+            if (env.profiler) env.profiler->unwind(profiled);
+        }
+    } unwind{env, from ? from->base : stack.size(), depth,
+        from ? from->profiled : env.profiler ? env.profiler->depth() : 0};
+
+    const Chunk* chunk = from ? from->chunk : &entry;
+    const Instr* code = chunk->code.data();
+    const Instr* ip = from ? from->ip : code;
+    const Data* consts = chunk->consts.data();
+    const Scope& globals = env.shared ? env.shared->global_scope :
+        env.global_scope;
+    size_t slots = env.frames.empty() ? 0 : env.frames.back().base;
+    // the Sites of chunk once a CALL_GLOBAL needs them, until a call may
+    // have grown env.sites
+    Sites* here = nullptr;
+    if (const Instr* to = from ? nullptr : tier(entry, 0, slots, env))
+        ip = to;
+
+#define VM_ENTER(CHUNK) do { \
+    chunk = (CHUNK); code = chunk->code.data(); \
+    consts = chunk->consts.data(); here = nullptr; \
+} while (0)
+
+#if defined(__GNUC__)
+    static const void* const labels[] = {
+#define X(OP) &&op_##OP,
+        VM_OPCODES(X)
+#undef X
+    };
+    VM_DISPATCH();
+#else
+dispatch:
+    switch (ip->op) {
+#endif
+
+    VM_OP(CONST): stack.push_back(consts[ip->a]); VM_NEXT();
+    VM_OP(LOAD_LOCAL): stack.push_back(stack[slots + ip->a]); VM_NEXT();
+    VM_OP(STORE_LOCAL): stack[slots + ip->a] = stack.back(); VM_NEXT();
+    VM_OP(LOAD_GLOBAL): {
+        const Cell* cell = globals.find(ip->a);
+        if (!cell || !cell->bound)
+            throw std::runtime_error("undefined symbol " +
+                symbol_name(ip->a));
+        stack.push_back(cell->val);
+    } VM_NEXT();
+    VM_OP(STORE_GLOBAL):
+        define(ip->a, stack.back(), env);
+        VM_NEXT();
+    VM_OP(POP): stack.pop_back(); VM_NEXT();
+    VM_OP(JUMP): VM_JUMP(ip->a);
+    VM_OP(LOOP): step(env); VM_TIER(ip->a);
+    VM_OP(JUMP_IF_NOT): {
+        const bool condition(stack.back()); stack.pop_back();
+        if (!condition) VM_JUMP(ip->a);
+    } VM_NEXT();
+
+    VM_ARITHMETIC(ADD, sum, +=)
+    VM_ARITHMETIC(SUB, sub, -=)
+    VM_ARITHMETIC(MUL, mul, *=)
+    VM_ARITHMETIC(DIV, div, /=)
+
+    VM_RELATIONAL(LT, lt, <)
+    VM_RELATIONAL(GT, gt, >)
+    VM_RELATIONAL(LTEQ, lteq, <=)
+    VM_RELATIONAL(GTEQ, gteq, >=)
+
+    VM_ARITHMETIC_K(ADD_K, sum, +=)
+    VM_ARITHMETIC_K(SUB_K, sub, -=)
+    VM_ARITHMETIC_K(MUL_K, mul, *=)
+    VM_ARITHMETIC_K(DIV_K, div, /=)
+
+    VM_RELATIONAL_K(LT_K, lt, <)
+    VM_RELATIONAL_K(GT_K, gt, >)
+    VM_RELATIONAL_K(LTEQ_K, lteq, <=)
+    VM_RELATIONAL_K(GTEQ_K, gteq, >=)
+
+    VM_OP(EQ): {
+        Data& lhs = stack[stack.size() - 2];
+        const double result = lhs == stack.back();
+        lhs = {Data::NUM, result}; stack.pop_back();
+    } VM_NEXT();
+    VM_LOGICAL(LAND, &&)
+    VM_LOGICAL(LOR, ||)
+    VM_OP(LNOT): stack.back() = {Data::NUM, double(!bool(stack.back()))};
+        VM_NEXT();
+
+    VM_OP(LOAD_REF): stack.push_back(stack[slots + ip->a].ref()); VM_NEXT();
+    VM_OP(STORE_REF):
+        if (env.shared) throw std::runtime_error(
+            "can't change captured locals in parallel fn");
+        stack[slots + ip->a].mut_ref() = stack.back();
+        VM_NEXT();
+    VM_OP(CLOSURE): {
+        // the closure made here last is filled in again unless a copy of
+        // it escaped, then it is left to its owners and a new one is made
+        const size_t from = stack.size() - consts[ip->a].fn().captures;
+        Data& site = sites(*chunk, env).closures[ip->b];
+        if (site.type() != Data::FN || site.shared()) site = consts[ip->a];
+        else if (!site.fn().chunk)
+            site.mut_fn().chunk = consts[ip->a].fn().chunk;
+        site.mut_fn().captured.assign(
+            std::make_move_iterator(stack.begin() + from),
+            std::make_move_iterator(stack.end()));
+        stack.resize(from); stack.push_back(site);
+    } VM_NEXT();
+    VM_OP(BUILTIN):
+        VM_BUILTIN(consts[ip->a].builtin(), consts[ip->b].vec(), ip + 1);
+    VM_OP(CALL_GLOBAL): {
+        // a monomorphic cache: the callee was checked already as long as
+        // no define changed its cell since. globals never shrink, so the
+        // cell is still there once it is in the cache
+        if (!here) here = &sites(*chunk, env);
+        Sites::Callee& cached = here->calls[ip->a];
+        if (cached.version == 0 ||
+            globals[ip->c].version != cached.version) {
+            const Cell* cell = globals.find(ip->c);
+            if (!cell || !cell->bound)
+                throw std::runtime_error("undefined symbol " +
+                    symbol_name(ip->c));
+            const Data& callee = cell->val;
+            const size_t argc = consts[chunk->calls[ip->a]].vec().size();
+            if (callee.type() != Data::BUILTIN && callee.type() != Data::FN)
+                throw std::runtime_error("unexpected data type in call");
+            if (callee.type() == Data::FN && callee.fn().params.size() != argc)
+                throw std::runtime_error("invalid number of params in fn call");
+            cached = {cell->version, callee.type() == Data::BUILTIN};
+        }
+        const Data& callee = globals[ip->c].val;
+        if (cached.builtin) VM_BUILTIN(callee.builtin(),
+            consts[chunk->calls[ip->a]].vec(), code + ip->b);
+        stack.push_back(callee);
+    } VM_NEXT();
+    VM_OP(CALL_BEGIN): {
+        const Data& callee = stack.back();
+        const Vec& args = consts[ip->a].vec();
+        if (callee.type() == Data::BUILTIN) {
+            const Builtin fn = callee.builtin();
+            stack.pop_back();
+            VM_BUILTIN(fn, args, code + ip->b);
+        } else if (callee.type() != Data::FN)
+            throw std::runtime_error("unexpected data type in call");
+        else if (callee.fn().params.size() != args.size())
+            throw std::runtime_error("invalid number of params in fn call");
+    } VM_NEXT();
+    VM_OP(CALL): call: {
+        const size_t base = stack.size() - ip->a;
+        if (!stack[base - 1].fn().chunk) compile(stack[base - 1], env);
+        const Fn& fn = stack[base - 1].fn();
+        if (fn.memo || (env.rebinds && !current(*fn.chunk, env))) {
+            // looked up and counted by invoke, which runs misses nested,
+            // as it does chunks compiled against a builtin now rebound
+            Data result = invoke(stack[base - 1], base, env);
+            stack.back() = std::move(result); here = nullptr;
+            VM_NEXT();
+        }
+        step_call(env);
+
+        open_frame(stack[base - 1], stack, base);
+        env.frames.push_back({&fn, base, chunk, ip + 1});
+        if (env.profiler) env.profiler->enter(Profiler::label(fn));
+        slots = base; VM_ENTER(fn.chunk.get());
+    } VM_TIER(0);
+    VM_OP(TAIL_CALL): {
+        // only frames run pushed itself have their callee below base
+        // a frame that may hold a cycle stays, see collect
+        const Fn& callee = stack[stack.size() - ip->a - 1].fn();
+        if (env.frames.size() == depth || callee.memo ||
+            (env.rebinds && callee.chunk && !current(*callee.chunk, env)) ||
+            (!env.frames.back().fn->slots.empty() &&
+            cyclic(*env.frames.back().fn, &stack[slots]))) goto call;
+
+        // replacing the callee frees the running chunk, so read ip first
+        step(env);
+        std::shared_ptr<const Chunk> left = std::move(env.frames.back().left);
+        if (chunk->closures)
+            env.frames.back().left = stack[slots - 1].fn().chunk;
+        const size_t argc = ip->a, from = stack.size() - argc - 1;
+        for (size_t i = 0; i <= argc; i++)
+            stack[slots - 1 + i] = std::move(stack[from + i]);
+        stack.resize(slots + argc);
+        if (left) release(*left, env);
+
+        if (!stack[slots - 1].fn().chunk) compile(stack[slots - 1], env);
+        const Fn& fn = stack[slots - 1].fn();
+        open_frame(stack[slots - 1], stack, slots);
+        env.frames.back().fn = &fn;
+        if (env.profiler) {
+            env.profiler->leave(); env.profiler->enter(Profiler::label(fn));
+        }
+        VM_ENTER(fn.chunk.get());
+    } VM_TIER(0);
+    VM_OP(FAIL):
+        throw std::runtime_error(consts[ip->a].str());
+    VM_OP(RET): {
+        if (env.frames.size() == depth) return std::move(stack.back());
+
+        const Frame frame = std::move(env.frames.back());
+        env.frames.pop_back();
+        if (env.profiler) env.profiler->leave();
+        Data result = std::move(stack.back());
+        if (!frame.fn->slots.empty())
+            collect(*frame.fn, &stack[slots], closures(*chunk, env));
+        stack.resize(frame.base);
+        if (chunk->closures) release(*chunk, env);
+        stack.back() = std::move(result);
+        if (frame.left) release(*frame.left, env);
+        slots = env.frames.empty() ? 0 : env.frames.back().base;
+        VM_ENTER(frame.chunk); ip = frame.ip;
+    } VM_DISPATCH();
+
+#if !defined(__GNUC__)
+    }
+#endif
+    throw std::runtime_error("unknown opcode in run");
+}
+
+} // namespace vm
+
 Env::Env() {
-    // arithmetic
-    global_scope["+"] = {Data::BUILTIN, builtin::sum};
-    global_scope["-"] = {Data::BUILTIN, builtin::sub};
-    global_scope["*"] = {Data::BUILTIN, builtin::mul};
-    global_scope["/"] = {Data::BUILTIN, builtin::div};
-
-    // relational
-    global_scope["<"] = {Data::BUILTIN, builtin::lt};
-    global_scope[">"] = {Data::BUILTIN, builtin::gt};
-    global_scope["<="] = {Data::BUILTIN, builtin::lteq};
-    global_scope[">="] = {Data::BUILTIN, builtin::gteq};
-    global_scope["=="] = {Data::BUILTIN, builtin::eq};
-
-    // logical
-    global_scope["&&"] = {Data::BUILTIN, builtin::land};
-    global_scope["||"] = {Data::BUILTIN, builtin::lor};
-    global_scope["!"] = {Data::BUILTIN, builtin::lnot};
-
-    global_scope["if"] = {Data::BUILTIN, builtin::cond_if};
-    global_scope["when"] = {Data::BUILTIN, builtin::when};
-    global_scope["while"] = {Data::BUILTIN, builtin::loop_while};
-    global_scope["for"] = {Data::BUILTIN, builtin::loop_for};
-
-    global_scope["="] = {Data::BUILTIN, builtin::assign};
-    global_scope["fn"] = {Data::BUILTIN, builtin::fn};
+    static const Scope builtins = [] {
+        Scope scope;
+        for (const auto& [name, fn] : builtin::table)
+            scope.at(intern(name)) = {{Data::BUILTIN, fn}, true, 1};
+        return scope;
+    }();
+    global_scope = builtins;
+}
+
+Program::Program(std::string_view in) : script(in) { compile(); }
+
+Program::Program(std::string_view in, const std::string& cache) :
+    script(in, cache) { compile(); }
+
+void Program::compile() {
+    Env env;
+    if (!script.ast.empty()) chunk = vm::compile(script.ast, env);
+}
+
+// value with each ref its fns capture swapped for a copy, the same one
+// wherever refs has it, and what holds those copied along. value itself
+// if there are none
+Data untie(const Data& value, std::vector<std::pair<Data, Data>>& refs) {
+    Data copy = value;
+    switch (value.type()) {
+    case Data::FN: {
+        const Fn& fn = value.fn();
+        for (size_t i = 0; i < fn.captured.size(); i++) {
+            const Data& held = fn.captured[i];
+            Data tied;
+            if (fn.ref(fn.params.size() + i) && held.type() == Data::VEC) {
+                auto it = std::find_if(refs.begin(), refs.end(),
+                    [&](const auto& ref) { return ref.first.identical(held); });
+                if (it != refs.end()) tied = it->second;
+                else {
+                    // in refs before what it holds, which may lead back
+                    Vec ref(current_resource()); ref.emplace_back();
+                    tied = {Data::VEC, std::move(ref)};
+                    refs.emplace_back(held, tied);
+                    Data val = untie(held.ref(), refs);
+                    tied.mut_ref() = std::move(val);
+                }
+            } else tied = untie(held, refs);
+            if (!tied.identical(held))
+                copy.mut_fn().captured[i] = std::move(tied);
+        }
+    } break;
+    case Data::VEC:
+        for (size_t i = 0; i < value.vec().size(); i++) {
+            Data tied = untie(value.vec()[i], refs);
+            if (!tied.identical(value.vec()[i]))
+                copy.mut_vec()[i] = std::move(tied);
+        }
+        break;
+    case Data::MAP: case Data::SET:
+        // a fn hashes the same without its refs, so keys stay where they are
+        for (size_t i = 0; i < value.table().size(); i++) {
+            const Table::Entry& entry = value.table().entries[i];
+            Data key = untie(entry.key, refs), val = untie(entry.val, refs);
+            if (!key.identical(entry.key))
+                copy.mut_table().entries[i].key = std::move(key);
+            if (!val.identical(entry.val))
+                copy.mut_table().entries[i].val = std::move(val);
+        }
+        break;
+    case Data::SLICE: {
+        const Slice& slice = value.slice();
+        Data of = untie(slice.of, refs);
+        if (!of.identical(slice.of))
+            copy = {Data::SLICE, Slice{std::move(of), slice.begin, slice.size}};
+    } break;
+    default: break;
+    }
+    return copy;
+}
+
+Snapshot::Snapshot(const Env& env) : tree_walk(env.tree_walk),
+    hot(env.hot), resource(env.resource) {
+    if (env.shared || !env.frames.empty() || env.suspended)
+        throw std::runtime_error("can't snapshot an env that is running");
+    const UseResource use(resource);
+    Scope scope = env.global_scope;
+    std::vector<std::pair<Data, Data>> refs;
+    for (uint32_t id = 0; id < scope.size(); id++) {
+        Cell* cell = scope.find(id);
+        if (!cell) continue;
+        Data val = untie(cell->val, refs);
+        if (val.identical(cell->val)) continue;
+        cell->val = std::move(val); tied.push_back(id);
+    }
+    globals = std::make_shared<const Scope>(std::move(scope));
+    rebinds = env.rebinds;
 }
 
+Env::Env(const Snapshot& snapshot) : global_scope(*snapshot.globals),
+    rebinds(snapshot.rebinds), tree_walk(snapshot.tree_walk),
+    resource(snapshot.resource), hot(snapshot.hot) {
+    const UseResource use(resource);
+    std::vector<std::pair<Data, Data>> refs;
+    for (const uint32_t id : snapshot.tied) {
+        Cell& cell = global_scope.at(id);
+        cell.val = untie(cell.val, refs);
+    }
+}
+
+Env::Env(Env* shared) : rebinds(shared->rebinds),
+    tree_walk(shared->tree_walk),
+    resource(locked(shared->resource)),
+    shared(shared->shared ? shared->shared : shared),
+    budget(shared->budget), hot(shared->hot) {}
+
 } // namespace tnyvec
\ No newline at end of file
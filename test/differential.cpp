@@ -0,0 +1,82 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <exception>
+
+#include "tnyvec.hpp"
+
+// how a file runs: through the walker, the vm alone, or the vm with every
+// chunk compiled to native the first time it is entered
+struct Mode { const char* name; bool tree_walk; uint32_t hot; };
+constexpr Mode modes[] = {
+    {"walk", true, tnyvec::Env::NEVER},
+    {"vm", false, tnyvec::Env::NEVER},
+    {"native", false, 0},
+};
+
+// what each top level form printed, or its error
+std::vector<std::string> run(const tnyvec::Script& script, const Mode& mode) {
+    tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+    std::vector<std::string> out;
+    for (const auto& form : script.ast) {
+        std::ostringstream text;
+        try {
+            tnyvec::print(tnyvec::exec({&form, 1}, env), text);
+        } catch (const std::exception& e) {
+            text << "error: " << e.what();
+        }
+        out.push_back(text.str());
+    }
+    return out;
+}
+
+// the lines of the .out file next to a .tny file, if it has one: what
+// each of its forms has to print
+std::vector<std::string> expected(const std::string& path) {
+    std::ifstream file(path.substr(0, path.rfind('.')) + ".out");
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line);) lines.push_back(line);
+    return lines;
+}
+
+// runs every file in every mode and prints each form whose output isn't
+// the same in all of them, or not what its .out file says. fails if
+// there was one
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " file.tny...\n";
+        return 1;
+    }
+
+    size_t forms = 0, failed = 0;
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file(argv[i]);
+        if (!file) {
+            std::cerr << "can't open " << argv[i] << '\n';
+            return 1;
+        }
+        std::stringstream in; in << file.rdbuf();
+        const tnyvec::Script script(in.str());
+
+        std::vector<std::vector<std::string>> outs;
+        for (const Mode& mode : modes) outs.push_back(run(script, mode));
+        const std::vector<std::string> want = expected(argv[i]);
+        for (size_t form = 0; form < script.ast.size(); form++, forms++) {
+            bool same = form >= want.size() || outs[0][form] == want[form];
+            for (const auto& out : outs)
+                same = same && out[form] == outs[0][form];
+            if (same) continue;
+            failed++;
+            std::cout << argv[i] << ": form " << form + 1 << '\n';
+            if (form < want.size())
+                std::cout << "  expected: " << want[form] << '\n';
+            for (size_t m = 0; m < std::size(modes); m++)
+                std::cout << "  " << modes[m].name << ": " << outs[m][form]
+                    << '\n';
+        }
+    }
+    std::cout << forms - failed << '/' << forms << " forms agree\n";
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,340 @@
+#include <string>
+#include <vector>
+#include <thread>
+#include <optional>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <iterator>
+#include <filesystem>
+#include <stdexcept>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "tnyvec.hpp"
+
+// what the .tny files can't check: the api a host embeds tnyvec through.
+// each check throws Failed once something isn't as it should be
+struct Failed : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+void check(bool ok, const std::string& what) {
+    if (!ok) throw Failed(what);
+}
+
+// the same as differential's modes
+struct Mode { const char* name; bool tree_walk; uint32_t hot; };
+constexpr Mode modes[] = {
+    {"walk", true, tnyvec::Env::NEVER},
+    {"vm", false, tnyvec::Env::NEVER},
+    {"native", false, 0},
+};
+
+tnyvec::Data run(const char* in, tnyvec::Env& env) {
+    const tnyvec::Script script(in);
+    return tnyvec::exec(script.ast, env);
+}
+
+// local fns calling each other are freed with the frame they were made in
+void cycles() {
+    for (const Mode& mode : modes) {
+        tnyvec::CountingResource counting;
+        tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+        env.resource = &counting;
+        run("(= p (fn (m) (= ev (fn (k) (if (== k 0) 1 (od (- k 1)))))"
+            " (= od (fn (k) (if (== k 0) 0 (ev (- k 1))))) (ev m)))", env);
+        const char* loop = "(for (= i 0) (< i n) (= i (+ i 1)) (p 5))";
+        run("(= n 1)", env); run(loop, env);
+        const size_t once = counting.bytes;
+        run("(= n 1000)", env); run(loop, env);
+        check(counting.bytes == once, std::string(mode.name) + ": " +
+            std::to_string(counting.bytes - once) + " bytes left by 999 calls");
+    }
+}
+
+std::string text(const tnyvec::Data& data) {
+    std::ostringstream out;
+    tnyvec::print(data, out);
+    return out.str();
+}
+
+// clones of a snapshot and the Env it was taken of change apart, refs
+// captured by fns included
+void snapshots() {
+    for (const Mode& mode : modes) {
+        tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+        run("(= count (fn () (= n 0) (fn () (= n (+ n 1)) n)))"
+            " (= c (count)) (= cs (vec c)) (= xs (vec 1)) (c)", env);
+        const tnyvec::Snapshot snapshot(env);
+        tnyvec::Env a(snapshot), b(snapshot);
+        const char* bump = "(push! xs 2) (c) ((nth cs 0))";
+        check(text(run(bump, a)) == "3", std::string(mode.name) +
+            ": c and cs don't share their ref in a clone");
+        run(bump, a);
+        run("(c) (c) (push! xs 3)", env);
+        const char* state = "(vec (c) (len xs))";
+        check(text(run(state, b)) == "(2 1)",
+            std::string(mode.name) + ": a clone sees another or the original");
+        check(text(run(state, a)) == "(6 3)",
+            std::string(mode.name) + ": a clone lost its own changes");
+        check(text(run(state, env)) == "(4 2)",
+            std::string(mode.name) + ": the original sees a clone");
+        tnyvec::Env c(snapshot);
+        check(text(run(state, c)) == "(2 1)",
+            std::string(mode.name) + ": the snapshot changed");
+    }
+}
+
+// workers of parallel builtins share the resource of their Env, which
+// needn't be thread safe
+void workers() {
+    std::pmr::unsynchronized_pool_resource unsynchronized;
+    tnyvec::CountingResource counting(&unsynchronized);
+    {
+        tnyvec::Env env; env.resource = &counting;
+        run("(= xs (vec))"
+            " (for (= i 0) (< i 4096) (= i (+ i 1)) (push! xs i))", env);
+        const tnyvec::Data sum = run("(preduce + 0 (pmap (fn (x)"
+            " (len (vec x (vec x) (map x x)))) xs))", env);
+        check(text(sum) == "12288", "pmap made " + text(sum));
+    }
+    check(counting.bytes == 0, std::to_string(counting.bytes) +
+        " bytes left once the Env is gone");
+}
+
+// an Env holds pages for the globals it binds, however many symbols the
+// process has interned before them
+void globals() {
+    for (int i = 0; i < 100000; i++)
+        tnyvec::intern("unbound" + std::to_string(i));
+    tnyvec::Env env;
+    const size_t before = env.global_scope.pages.size();
+    run("(= late 1)", env);
+    const tnyvec::Snapshot snapshot(env);
+    const tnyvec::Env clone(snapshot);
+    size_t made = 0;
+    for (const auto& page : clone.global_scope.pages) made += bool(page);
+    check(made <= before + 1, std::to_string(made) + " pages for " +
+        std::to_string(before) + " builtin pages and one global");
+    check(text(run("late", env)) == "1", "late isn't bound");
+}
+
+// one compiled Program runs on many threads at once, each in an Env of
+// its own, and defining globals in one doesn't reach the others
+void programs() {
+    const tnyvec::Program program("(= fib (fn (n) (if (< n 2) n"
+        " (+ (fib (- n 1)) (fib (- n 2)))))) (= xs (vec))"
+        " (for (= i 0) (< i 20) (= i (+ i 1)) (push! xs (fib i))) (len xs)");
+    std::vector<std::string> results(8);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < results.size(); t++)
+        threads.emplace_back([&, t] {
+            const Mode& mode = modes[t % std::size(modes)];
+            tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+            run("(= fib 0)", env);
+            try {
+                for (int i = 0; i < 10; i++) tnyvec::exec(program, env);
+                results[t] = text(run("(vec (len xs) (nth xs 19))", env));
+            } catch (const std::exception& e) { results[t] = e.what(); }
+        });
+    for (std::thread& thread : threads) thread.join();
+    for (size_t t = 0; t < results.size(); t++)
+        check(results[t] == "(20 4181)", std::string(modes[t %
+            std::size(modes)].name) + " thread made " + results[t]);
+}
+
+// an async builtin hands the host its evaluated args, and the run goes on
+// from there with what the host gives back, in the vm and natively
+tnyvec::Data fetch(tnyvec::Args args, tnyvec::Env& env) {
+    return tnyvec::suspend(fetch, args, env);
+}
+
+void async() {
+    const tnyvec::Program program("(= total 0) (= look (fn (k)"
+        " (* 2 (fetch k (+ k 1))))) (for (= i 0) (< i 5) (= i (+ i 1))"
+        " (= total (+ total (look i)))) (+ total (fetch 100 0))");
+    for (const Mode& mode : modes) {
+        if (mode.tree_walk) continue; // the walker can't suspend
+        const std::string name = mode.name;
+        tnyvec::Env env; env.hot = mode.hot;
+        tnyvec::define(tnyvec::intern("fetch"),
+            {tnyvec::Data::BUILTIN, fetch}, env);
+        std::optional<tnyvec::Data> result = tnyvec::start(program, env);
+        size_t calls = 0;
+        while (!result) {
+            check(env.suspended && env.suspended->args.size() == 2,
+                name + ": suspended without both args");
+            const double k = env.suspended->args[0].num();
+            const double v = env.suspended->args[1].num();
+            check(k == 100 ? v == 0 : v == k + 1,
+                name + ": args weren't evaluated");
+            calls++;
+            result = tnyvec::resume(env, {tnyvec::Data::NUM, k + v});
+        }
+        check(calls == 6, name + ": " + std::to_string(calls) + " suspends");
+        check(text(*result) == "150", name + ": resumed to " + text(*result));
+        check(!env.suspended && env.stack.empty(),
+            name + ": a finished run left state behind");
+        bool thrown = false;
+        try { tnyvec::exec(program, env); }
+        catch (const std::runtime_error&) { thrown = true; }
+        check(thrown, name + ": exec let a builtin suspend");
+    }
+}
+
+// what a run throws once it uses up its budget, the Env it ran in left
+// as it was before that run
+std::string exceeded(const char* in, tnyvec::Env& env) {
+    try { run(in, env); }
+    catch (const tnyvec::BudgetExceeded& e) { return e.what(); }
+    return "nothing";
+}
+
+void budgets() {
+    for (const Mode& mode : modes) {
+        const std::string name = mode.name;
+        tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+        tnyvec::Budget budget; env.budget = &budget;
+        budget.steps = 100000;
+        const std::string steps = exceeded("(while 1 1)", env);
+        check(steps == "step budget exceeded", name + ": a loop got " + steps);
+        check(budget.used <= budget.steps + tnyvec::Budget::CHECK_EVERY,
+            name + ": " + std::to_string(budget.used) + " steps used");
+        budget.steps = -1; budget.depth = 200;
+        run("(= f (fn (n) (+ 1 (f (+ n 1)))))", env);
+        const std::string depth = exceeded("(f 0)", env);
+        check(depth == "call depth exceeded",
+            name + ": a recursion got " + depth);
+        check(env.stack.empty() && env.frames.empty(),
+            name + ": an exceeded run left frames behind");
+        run("(= g (fn (n) (if (== n 0) 0 (+ 1 (g (- n 1))))))", env);
+        check(text(run("(g 150)", env)) == "150",
+            name + ": the Env doesn't run within its budget");
+        budget.used = 0; budget.steps = 100000;
+        check(text(run("(for (= i 0) (< i 1000) (= i (+ i 1)) 0) i", env)) ==
+            "1000", name + ": a loop within the budget didn't finish");
+    }
+}
+
+// the call tree a Profiler keeps comes out as flamegraph.pl input and as
+// a table with a line per fn
+void profiles() {
+    for (const Mode& mode : modes) {
+        const std::string name = mode.name;
+        tnyvec::Env env; env.tree_walk = mode.tree_walk; env.hot = mode.hot;
+        run("(= inner (fn (n) (= s 0) (for (= i 0) (< i n) (= i (+ i 1))"
+            " (= s (+ s i))) s)) (= outer (fn () (= t 0)"
+            " (for (= j 0) (< j 10) (= j (+ j 1)) (= t (+ t (inner 20000))))"
+            " t))", env);
+        std::ostringstream folded, report;
+        {
+            tnyvec::Profiler profiler(env);
+            check(text(run("(outer)", env)) == "1999900000",
+                name + ": profiled wrong");
+            profiler.folded(folded); profiler.report(report);
+        }
+        check(!env.profiler, name + ": the profiler stayed attached");
+
+        std::istringstream lines(folded.str());
+        bool nested = false;
+        for (std::string line; std::getline(lines, line);) {
+            const size_t space = line.rfind(' ');
+            check(line.starts_with("exec") && space != std::string::npos &&
+                line.find_first_not_of("0123456789", space + 1) ==
+                std::string::npos && space + 1 < line.size(),
+                name + ": folded line " + line);
+            // the walker has the special forms and builtins in between
+            const std::string path = line.substr(0, space);
+            nested |= path.starts_with("exec;outer;") &&
+                path.ends_with(";inner");
+        }
+        check(nested, name + ": inner isn't in outer in\n" + folded.str());
+
+        lines.clear(); lines.str(report.str());
+        std::string line;
+        std::getline(lines, line);
+        check(line == "name\tcalls\tincl_ms\texcl_ms\tmade",
+            name + ": report header " + line);
+        size_t inner = 0;
+        for (; std::getline(lines, line);) {
+            check(std::count(line.begin(), line.end(), '\t') == 4,
+                name + ": report line " + line);
+            if (line.starts_with("inner\t"))
+                inner = std::stoul(line.substr(6));
+        }
+        check(inner == 10, name + ": inner called " +
+            std::to_string(inner) + " times");
+    }
+}
+
+std::string contents(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), {}};
+}
+
+// an ast cache only stands for the source it was parsed from, one of
+// another source or that is cut short or garbled is parsed past and
+// written again
+void caches() {
+    const std::string path = (std::filesystem::temp_directory_path() /
+        ("tnyvec_host" + std::to_string(getpid()) + ".ast")).string();
+    const char* in = "(= sq (fn (x) (* x x))) (vec (sq 3) \"n\" (vec 1.5))";
+    const char* out = "(9 \"n\" (1.5))";
+    const auto exec = [&](const char* in) {
+        tnyvec::Env env;
+        return text(tnyvec::exec(tnyvec::Program(in, path), env));
+    };
+    check(exec(in) == out, "the source parsed wrong");
+    const std::string fresh = contents(path);
+    check(fresh.starts_with("tnyast"), "no cache was written");
+    check(exec(in) == out && contents(path) == fresh,
+        "a cache of the same source didn't load as is");
+
+    check(exec("(+ 1 2)") == "3", "a stale cache was loaded");
+    check(contents(path) != fresh, "a stale cache wasn't written again");
+
+    std::string flipped = fresh; flipped.back() ^= 1;
+    const std::string corrupt[] = {
+        "", "tnyast", fresh.substr(0, fresh.size() / 2), flipped,
+        fresh + '\0',
+    };
+    for (const std::string& bytes : corrupt) {
+        std::ofstream(path, std::ios::binary) << bytes;
+        check(exec(in) == out, "a cut short or garbled cache of " +
+            std::to_string(bytes.size()) + " bytes was loaded");
+        check(contents(path) == fresh, "a corrupt cache of " +
+            std::to_string(bytes.size()) + " bytes wasn't written again");
+    }
+    std::filesystem::remove(path);
+}
+
+constexpr struct { const char* name; void (*fn)(); } checks[] = {
+    {"cycles", cycles},
+    {"snapshots", snapshots},
+    {"workers", workers},
+    {"globals", globals},
+    {"programs", programs},
+    {"async", async},
+    {"budgets", budgets},
+    {"profiles", profiles},
+    {"caches", caches},
+};
+
+int main() {
+    // the parallel checks need workers even on one core
+    setenv("TNYVEC_THREADS", "4", false);
+    size_t failed = 0;
+    for (const auto& [name, fn] : checks) {
+        try {
+            fn();
+        } catch (const std::exception& e) {
+            failed++;
+            std::cout << name << ": " << e.what() << '\n';
+        }
+    }
+    std::cout << std::size(checks) - failed << '/' << std::size(checks)
+        << " host checks pass\n";
+    return failed ? 1 : 0;
+}